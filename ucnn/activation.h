@@ -30,6 +30,8 @@
 #include <algorithm>
 #include <string>
 
+#include "core_math.h"
+
 namespace ucnn {
 
 // not using class because I thought this may be faster than vptrs
@@ -85,35 +87,85 @@ namespace sigmoid
 	const char name[]="sigmoid";
 };
 
-/*
+// softmax works on the whole output vector so it can't go through activation_function
+// it is used by the softmax_layer instead
 namespace softmax 
 {
-	void f(float *in_out, int size=0) 
-	{ 
-		float max= in_out[0];
-		for(int i=1; i<size; i++) if(in_out[i] > max) max= in_out[i];
-	
-		float denom=0;
-		for(int i=0; i<size; i++) denom+= std::exp(in_out[i] - max);
-		
-		for(int i=0; i<size; i++)
-			in_out[i] = std::exp(in_out[i] - max)/ denom;
+	// out = exp(in-max)/sum(exp(in-max)). in and out can be the same
+	inline void f(const float *in, float *out, const int size)
+	{
+		int i = 0;
+		float max = in[0];
+		float denom = 0;
+#ifdef UCNN_SSE3
+		if (size >= 4)
+		{
+			__m128 vmax = _mm_loadu_ps(in);
+			for (i = 4; i + 4 <= size; i += 4) vmax = _mm_max_ps(vmax, _mm_loadu_ps(in + i));
+			max = hmax_sse(vmax);
+		}
+		for (; i < size; i++) if (in[i] > max) max = in[i];
 
+		const __m128 m = _mm_set1_ps(max);
+		__m128 vsum = _mm_setzero_ps();
+		for (i = 0; i + 4 <= size; i += 4)
+		{
+			const __m128 e = exp_sse(_mm_sub_ps(_mm_loadu_ps(in + i), m));
+			_mm_storeu_ps(out + i, e);
+			vsum = _mm_add_ps(vsum, e);
+		}
+		denom = hsum_sse(vsum);
+#else
+		for (i = 1; i < size; i++) if (in[i] > max) max = in[i];
+		i = 0;
+#endif
+		for (; i < size; i++) { out[i] = std::exp(in[i] - max); denom += out[i]; }
+
+		const float inv = 1.f / denom;
+		i = 0;
+#ifdef UCNN_SSE3
+		const __m128 vinv = _mm_set1_ps(inv);
+		for (; i + 4 <= size; i += 4) _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(out + i), vinv));
+#endif
+		for (; i < size; i++) out[i] *= inv;
 	}
 
-	void df(float *in_out, int size=0) 
+	// fused softmax + cross entropy gradient wrt the softmax input: delta = p - onehot(label)
+	// returns the 0.5*||p-onehot||^2 energy so it can be used the same way as the other outputs
+	inline float d_cross_entropy(const float *p, float *delta, const int size, const int label)
 	{
-		for(int i=0; i<size; i++) 
+		int i = 0;
+		float E = 0;
+#ifdef UCNN_SSE3
+		__m128 vE = _mm_setzero_ps();
+		for (; i + 4 <= size; i += 4)
 		{
-			in_out[i] = in_out[i]*(1.f-in_out[i]);
+			const __m128 v = _mm_loadu_ps(p + i);
+			_mm_storeu_ps(delta + i, v);
+			vE = _mm_add_ps(vE, _mm_mul_ps(v, v));
 		}
+		E = hsum_sse(vE);
+#endif
+		for (; i < size; i++) { delta[i] = p[i]; E += p[i] * p[i]; }
+		if (label >= 0 && label < size)
+		{
+			delta[label] -= 1.f;
+			// (p-1)^2 = p^2 - 2p + 1
+			E += 1.f - 2.f*p[label];
+		}
+		return 0.5f*E;
 	}
 
-	// oj = exp (zj - m - log{sum_i{exp(zi-m)}})
-
+	// gradient wrt the softmax input when given dE/dp in g: g_i = p_i*(g_i - sum_k g_k*p_k)
+	inline void df(const float *p, float *g, const int size)
+	{
+		float s = 0;
+		for (int i = 0; i < size; i++) s += g[i] * p[i];
+		for (int i = 0; i < size; i++) g[i] = p[i] * (g[i] - s);
+	}
 
+	const char name[]="softmax";
 };
-*/
 namespace none
 {
 	inline float f(float *in, int i, int size, float bias) {return 0;};
@@ -0,0 +1,482 @@
+// == ucnn ====================================================================
+//
+//    Copyright (c) gnawice@gnawice.com. All rights reserved.
+//	  See LICENSE in root folder
+//
+//    This file is part of ucnn.
+//
+//    uncc is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as published
+//    by the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    ucnn is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with ucnn.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+//    compress.h: model compression tools (pruning, channel pruning, low rank) for a trained network
+//
+// ==================================================================== ucnn ==
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <sstream>
+
+#include "network.h"
+
+namespace ucnn {
+
+// connections into fully connected layers (all of them, or only the one feeding layer_name)
+inline std::vector<int> fc_connections(network &net, const char *layer_name = NULL)
+{
+	std::vector<int> c;
+	for (int j = 0; j < (int)net.W.size(); j++)
+	{
+		if (layer_name && net.layer_graph[j].second.compare(layer_name) != 0) continue;
+		if (dynamic_cast<fully_connected_layer*>(net.bottom_layer(j)) == NULL) continue;
+		c.push_back(j);
+	}
+	return c;
+}
+
+inline float zero_fraction(const std::vector<matrix *> &w)
+{
+	size_t zeros = 0, total = 0;
+	__for__(auto m __in__ w)
+	{
+		for (int i = 0; i < m->size(); i++) if (m->x[i] == 0) zeros++;
+		total += m->size();
+	}
+	return total ? (float)zeros / (float)total : 0.f;
+}
+
+// zero fully connected weights with |w| < threshold
+// returns the fraction of those weights that are zero afterwards
+inline float prune_threshold(network &net, const float threshold, const char *layer_name = NULL)
+{
+	std::vector<matrix *> pruned;
+	__for__(auto j __in__ fc_connections(net, layer_name))
+	{
+		matrix *w = net.unpack_weights(j);
+		for (int i = 0; i < w->size(); i++) if (std::fabs(w->x[i]) < threshold) w->x[i] = 0;
+		pruned.push_back(w);
+	}
+	const float f = zero_fraction(pruned);
+	net.update_sparse_weights();
+	return f;
+}
+
+// zero the weakest 4x4 blocks (by L1 norm) of each fully connected matrix until 'sparsity' of its blocks are zero.
+// pruning whole blocks is what lets the block sparse kernel skip work - single weights would leave most blocks in use
+// returns the fraction of those weights that are zero afterwards
+inline float prune_blocks(network &net, const float sparsity, const char *layer_name = NULL)
+{
+	std::vector<matrix *> pruned;
+	__for__(auto j __in__ fc_connections(net, layer_name))
+	{
+		matrix *w = net.unpack_weights(j);
+		pruned.push_back(w);
+		const int br = (w->rows + 3) / 4, bc = (w->cols + 3) / 4;
+		const int cut = (int)(sparsity*br*bc);
+		if (cut <= 0) continue;
+		// (norm, block index)
+		std::vector<std::pair<float, int>> norm(br*bc);
+		for (int r = 0; r < br; r++)
+			for (int c = 0; c < bc; c++)
+			{
+				float n = 0;
+				for (int jj = r * 4; jj < r * 4 + 4 && jj < w->rows; jj++)
+					for (int ii = c * 4; ii < c * 4 + 4 && ii < w->cols; ii++) n += std::fabs(w->x[ii + jj*w->cols]);
+				norm[r*bc + c] = std::make_pair(n, r*bc + c);
+			}
+		std::nth_element(norm.begin(), norm.begin() + (cut - 1), norm.end());
+		for (int k = 0; k < cut; k++)
+		{
+			const int r = norm[k].second / bc, c = norm[k].second % bc;
+			for (int jj = r * 4; jj < r * 4 + 4 && jj < w->rows; jj++)
+				for (int ii = c * 4; ii < c * 4 + 4 && ii < w->cols; ii++) w->x[ii + jj*w->cols] = 0;
+		}
+	}
+	const float f = zero_fraction(pruned);
+	net.update_sparse_weights();
+	return f;
+}
+
+#ifndef NO_TRAINING_CODE
+// short retrain after pruning. runs epochs of train_class over the samples and puts the pruned zeros back
+// after every mini-batch update so they stay pruned. the network needs an optimizer
+inline void fine_tune_pruned(network &net, const std::vector<std::vector<float>> &samples, const std::vector<int> &labels,
+	const int epochs = 1, const char *loss_function = "mse")
+{
+	// remember what was pruned
+	std::vector<std::pair<int, std::vector<int>>> mask;
+	__for__(auto j __in__ fc_connections(net))
+	{
+		std::vector<int> zeros;
+		for (int i = 0; i < net.W[j]->size(); i++) if (net.W[j]->x[i] == 0) zeros.push_back(i);
+		if (zeros.size()) mask.push_back(std::make_pair(j, zeros));
+	}
+
+	for (int e = 0; e < epochs; e++)
+	{
+		net.start_epoch(loss_function);
+		int updates = net.train_updates;
+		for (int k = 0; k < (int)samples.size(); k++)
+		{
+			net.train_class((float *)samples[k].data(), labels[k]);
+			if (net.train_updates == updates) continue;
+			updates = net.train_updates;
+			__for__(auto &m __in__ mask) __for__(auto i __in__ m.second) net.W[m.first]->x[i] = 0;
+		}
+		net.end_epoch();
+		__for__(auto &m __in__ mask) __for__(auto i __in__ m.second) net.W[m.first]->x[i] = 0;
+	}
+}
+#endif
+
+// a network taken apart so a tool can change it: layers (name, config, bias) and connections (top, bottom, weights)
+// apply() rebuilds the network from it through the normal model reader
+struct model_rewrite
+{
+	std::vector<std::string> name, config;
+	std::vector<std::vector<float>> bias;
+	std::vector<std::pair<std::string, std::string>> graph;
+	std::vector<std::vector<float>> weights;
+
+	model_rewrite() {}
+	// copy of the network as it is
+	model_rewrite(network &net)
+	{
+		__for__(auto l __in__ net.layer_sets[0]) add_layer(l->name, l->get_config_string(), std::vector<float>(l->bias.x, l->bias.x + l->bias.size()));
+		for (int j = 0; j < (int)net.W.size(); j++)
+		{
+			matrix tmp;
+			const matrix &w = net.float_weights(j, tmp);
+			add_connection(net.layer_graph[j].first, net.layer_graph[j].second, std::vector<float>(w.x, w.x + w.size()));
+		}
+	}
+	// config strings from get_config_string() end with a newline already
+	void add_layer(const std::string &n, const std::string &c, const std::vector<float> &b)
+	{
+		name.push_back(n); config.push_back(c); bias.push_back(b);
+		if (config.back().empty() || config.back()[config.back().size() - 1] != '\n') config.back() += "\n";
+	}
+	void add_connection(const std::string &top, const std::string &bottom, const std::vector<float> &w)
+	{
+		graph.push_back(std::make_pair(top, bottom)); weights.push_back(w);
+	}
+
+	bool apply(network &net)
+	{
+		std::stringstream ss(std::ios::in | std::ios::out | std::ios::binary);
+		ss << (int)name.size() << std::endl;
+		for (int k = 0; k < (int)name.size(); k++) ss << name[k] << std::endl << config[k];
+		ss << (int)graph.size() << std::endl;
+		for (int j = 0; j < (int)graph.size(); j++) ss << graph[j].first << std::endl << graph[j].second << std::endl;
+		ss << (int)1 << std::endl;
+		__for__(auto &b __in__ bias) ss.write((char*)b.data(), b.size()*sizeof(float));
+		__for__(auto &w __in__ weights) ss.write((char*)w.data(), w.size()*sizeof(float));
+		net.clear();
+		return net.read(ss);
+	}
+};
+
+// copy the kept channels (planes of 'plane' floats) of src to dst
+inline void copy_channels(const float *src, float *dst, const std::vector<int> &keep, const int plane)
+{
+	for (int c = 0; c < (int)keep.size(); c++) memcpy(dst + c*plane, src + keep[c] * plane, plane*sizeof(float));
+}
+
+// structured pruning: drops the weakest maps of convolution layers and rebuilds the network smaller
+// saliency "l1" ranks a map by the sum of |w| of its filters, "activation" by its mean |output| over the samples
+// keep_fraction of the maps (at least one) are kept in every convolution layer, or only in layer_name.
+// the network is rebuilt in place with the same layer names and graph: smaller 'maps' and the layers under it
+// lose the matching input filters (convolution) or input columns (fully connected). pool/dropout pass channels through.
+// returns false if nothing was removed. convolution layers with more than one input are left alone
+inline bool prune_channels(network &net, const float keep_fraction, const char *saliency = "l1",
+	const std::vector<std::vector<float>> *samples = NULL, const char *layer_name = NULL)
+{
+	std::vector<base_layer *> &layers = net.layer_sets[0];
+	const int layer_cnt = (int)layers.size();
+	const int w_cnt = (int)net.W.size();
+
+	// the (single) connection into each layer, -1 if none or more than one
+	std::vector<int> input(layer_cnt, -1), inputs(layer_cnt, 0);
+	for (int j = 0; j < w_cnt; j++)
+	{
+		const int b = net.layer_map[net.layer_graph[j].second];
+		input[b] = j; inputs[b]++;
+	}
+	for (int k = 0; k < layer_cnt; k++) if (inputs[k] != 1) input[k] = -1;
+
+	// score the maps
+	const bool use_activation = std::string("activation").compare(saliency) == 0;
+	if (use_activation && (samples == NULL || samples->size() == 0)) bail("activation saliency needs samples");
+	std::vector<std::vector<float>> score(layer_cnt);
+	for (int k = 0; k < layer_cnt; k++)
+	{
+		convolution_layer *conv = dynamic_cast<convolution_layer*>(layers[k]);
+		if (conv == NULL || input[k] < 0) continue;
+		if (layer_name && conv->name.compare(layer_name) != 0) continue;
+		score[k].assign(conv->maps, 0.f);
+		if (use_activation) continue;
+		matrix tmp;
+		const matrix &w = net.float_weights(input[k], tmp);
+		const int kernel_size = conv->kernel_cols*conv->kernel_rows;
+		const int top_chans = w.chans / conv->maps;
+		for (int map = 0; map < conv->maps; map++)
+			for (int c = 0; c < top_chans; c++)
+				for (int i = 0; i < kernel_size; i++) score[k][map] += std::fabs(w.x[(map + c*conv->maps)*kernel_size + i]);
+	}
+	if (use_activation)
+	{
+		__for__(auto &sample __in__ *samples)
+		{
+			net.forward(sample.data(), 0);
+			for (int k = 0; k < layer_cnt; k++)
+			{
+				if (score[k].empty()) continue;
+				const matrix &n = layers[k]->node;
+				const int plane = n.cols*n.rows;
+				for (int map = 0; map < n.chans; map++)
+					for (int i = 0; i < plane; i++) score[k][map] += std::fabs(n.x[map*plane + i]);
+			}
+		}
+	}
+
+	// kept output channels of every layer, in order
+	std::vector<std::vector<int>> keep(layer_cnt);
+	bool changed = false;
+	for (int k = 0; k < layer_cnt; k++)
+	{
+		const int chans = layers[k]->node.chans;
+		if (!score[k].empty())
+		{
+			int n = (int)(keep_fraction*chans + 0.5f);
+			if (n < 1) n = 1;
+			if (n > chans) n = chans;
+			std::vector<std::pair<float, int>> rank(chans);
+			for (int c = 0; c < chans; c++) rank[c] = std::make_pair(-score[k][c], c);
+			std::sort(rank.begin(), rank.end());
+			for (int c = 0; c < n; c++) keep[k].push_back(rank[c].second);
+			std::sort(keep[k].begin(), keep[k].end());
+			if (n < chans) changed = true;
+			continue;
+		}
+		// layers that keep the channel layout of their input follow it
+		if (input[k] >= 0 && dynamic_cast<convolution_layer*>(layers[k]) == NULL && dynamic_cast<fully_connected_layer*>(layers[k]) == NULL)
+		{
+			const int t = net.layer_map[net.layer_graph[input[k]].first];
+			if (layers[t]->node.chans == chans) { keep[k] = keep[t]; continue; }
+		}
+		for (int c = 0; c < chans; c++) keep[k].push_back(c);
+	}
+	if (!changed) return false;
+
+	// rebuild with the kept channels
+	model_rewrite m;
+	for (int k = 0; k < layer_cnt; k++)
+	{
+		const matrix &b = layers[k]->bias;
+		const int plane = b.cols*b.rows;
+		std::vector<float> v(plane*keep[k].size());
+		if (b.chans == layers[k]->node.chans) copy_channels(b.x, v.data(), keep[k], plane);
+		else v.assign(b.x, b.x + b.size());
+		convolution_layer *conv = dynamic_cast<convolution_layer*>(layers[k]);
+		if (conv)
+		{
+			// same config with the new map count (also keeps binary_convolution)
+			std::istringstream iss(conv->get_config_string());
+			std::string type;
+			iss >> type;
+			m.add_layer(conv->name, type + " " + int2str(conv->kernel_cols) + " " + int2str(conv->kernel_rows) + " " + int2str(keep[k].size()) + " " + conv->p_act->name, v);
+		}
+		else m.add_layer(layers[k]->name, layers[k]->get_config_string(), v);
+	}
+	for (int j = 0; j < w_cnt; j++)
+	{
+		const int t = net.layer_map[net.layer_graph[j].first];
+		const int b = net.layer_map[net.layer_graph[j].second];
+		matrix tmp;
+		const matrix &w = net.float_weights(j, tmp);
+		std::vector<float> v;
+		convolution_layer *conv = dynamic_cast<convolution_layer*>(layers[b]);
+		if (conv && input[b] == j)
+		{
+			// filter (map, c) is at (map + c*maps)*kernel_size
+			const int kernel_size = conv->kernel_cols*conv->kernel_rows;
+			for (int c = 0; c < (int)keep[t].size(); c++)
+				for (int m = 0; m < (int)keep[b].size(); m++)
+				{
+					const float *f = w.x + (keep[b][m] + keep[t][c] * conv->maps)*kernel_size;
+					v.insert(v.end(), f, f + kernel_size);
+				}
+		}
+		else if (dynamic_cast<fully_connected_layer*>(layers[b]))
+		{
+			// one row per output, inputs in the channel layout of the layer above
+			const int plane = layers[t]->node.cols*layers[t]->node.rows;
+			v.resize(w.rows*plane*keep[t].size());
+			for (int r = 0; r < w.rows; r++) copy_channels(w.x + r*w.cols, v.data() + r*plane*keep[t].size(), keep[t], plane);
+		}
+		else v.assign(w.x, w.x + w.size());
+		m.add_connection(net.layer_graph[j].first, net.layer_graph[j].second, v);
+	}
+	return m.apply(net);
+}
+
+// one-sided (Hestenes) Jacobi: rotates pairs of rows of a (n x m, row major) until all rows are orthogonal
+// the same rotations are applied to j (starts as identity, n x n), so the original a is j' * (rotated a)
+inline void jacobi_orthogonalize_rows(std::vector<double> &a, const int n, const int m, std::vector<double> &j)
+{
+	j.assign(n*n, 0.);
+	for (int i = 0; i < n; i++) j[i*n + i] = 1.;
+	std::vector<double> norm(n);
+	for (int sweep = 0; sweep < 60; sweep++)
+	{
+		for (int i = 0; i < n; i++) { double sum = 0; for (int k = 0; k < m; k++) sum += a[i*m + k] * a[i*m + k]; norm[i] = sum; }
+		int rotations = 0;
+		for (int p = 0; p < n; p++)
+			for (int q = p + 1; q < n; q++)
+			{
+				double *rp = &a[p*m], *rq = &a[q*m];
+				double gamma = 0;
+				for (int k = 0; k < m; k++) gamma += rp[k] * rq[k];
+				if (std::fabs(gamma) <= 1e-15*std::sqrt(norm[p] * norm[q]) || gamma == 0) continue;
+				rotations++;
+				const double zeta = (norm[q] - norm[p]) / (2.*gamma);
+				const double t = (zeta >= 0 ? 1. : -1.) / (std::fabs(zeta) + std::sqrt(1. + zeta*zeta));
+				const double c = 1. / std::sqrt(1. + t*t), s = c*t;
+				for (int k = 0; k < m; k++) { const double x = rp[k], y = rq[k]; rp[k] = c*x - s*y; rq[k] = s*x + c*y; }
+				double *jp = &j[p*n], *jq = &j[q*n];
+				for (int k = 0; k < n; k++) { const double x = jp[k], y = jq[k]; jp[k] = c*x - s*y; jq[k] = s*x + c*y; }
+				norm[p] -= t*gamma; norm[q] += t*gamma;
+			}
+		if (rotations == 0) break;
+	}
+}
+
+// truncated svd of w (rows x cols): w ~= u * diag(s) * vt with u rows x rank, vt rank x cols
+// returns all the singular values, largest first
+inline std::vector<double> svd_truncated(const matrix &w, const int rank, std::vector<double> &u, std::vector<double> &vt)
+{
+	const int rows = w.rows, cols = w.cols;
+	// orthogonalize the shorter side so the rotation matrix is small
+	const bool by_rows = rows <= cols;
+	const int n = by_rows ? rows : cols, m = by_rows ? cols : rows;
+	std::vector<double> a(n*m), j;
+	for (int i = 0; i < rows; i++)
+		for (int k = 0; k < cols; k++)
+		{
+			if (by_rows) a[i*m + k] = w.x[i*cols + k];
+			else a[k*m + i] = w.x[i*cols + k];
+		}
+	jacobi_orthogonalize_rows(a, n, m, j);
+
+	// row i of a is s_i times a singular vector, row i of j is the matching one on the other side
+	std::vector<std::pair<double, int>> order(n);
+	for (int i = 0; i < n; i++)
+	{
+		double sum = 0;
+		for (int k = 0; k < m; k++) sum += a[i*m + k] * a[i*m + k];
+		order[i] = std::make_pair(-std::sqrt(sum), i);
+	}
+	std::sort(order.begin(), order.end());
+	std::vector<double> sv(n);
+	for (int i = 0; i < n; i++) sv[i] = -order[i].first;
+
+	u.assign(rows*rank, 0.); vt.assign(rank*cols, 0.);
+	for (int r = 0; r < rank && r < n; r++)
+	{
+		if (sv[r] <= 0) break;
+		const double *ar = &a[order[r].second*m], *jr = &j[order[r].second*n];
+		for (int i = 0; i < rows; i++) u[i*rank + r] = by_rows ? jr[i] : ar[i] / sv[r];
+		for (int k = 0; k < cols; k++) vt[r*cols + k] = by_rows ? ar[k] / sv[r] : jr[k];
+	}
+	return sv;
+}
+
+// low rank factorization of a fully connected layer: top -> layer becomes top -> layer_low -> layer
+// with layer_low = "fully_connected rank identity" holding sqrt(s)*vt and the layer keeping its activation and bias with u*sqrt(s).
+// rank is the smallest that keeps 'energy' of the squared singular values, or if speedup > 0 the largest that gives
+// rank*(rows+cols) <= rows*cols/speedup. returns the rank, or 0 if the layer was left alone (no gain, not fully connected)
+inline int factor_fully_connected(network &net, const char *layer_name, const float energy = 0.95f, const float speedup = 0.f)
+{
+	if (net.layer_map.count(layer_name) == 0) return 0;
+	if (dynamic_cast<fully_connected_layer*>(net.layer_sets[0][net.layer_map[layer_name]]) == NULL) return 0;
+	// needs exactly one input
+	int w_index = -1;
+	for (int j = 0; j < (int)net.W.size(); j++)
+	{
+		if (net.layer_graph[j].second.compare(layer_name) != 0) continue;
+		if (w_index >= 0) return 0;
+		w_index = j;
+	}
+	if (w_index < 0) return 0;
+
+	matrix tmp;
+	const matrix &w = net.float_weights(w_index, tmp);
+	const int rows = w.rows, cols = w.cols;
+	const int full = rows < cols ? rows : cols;
+	std::vector<double> u, vt;
+	const std::vector<double> sv = svd_truncated(w, full, u, vt);
+	int rank = 0;
+	if (speedup > 0) rank = (int)((double)rows*cols / (speedup*(double)(rows + cols)));
+	else
+	{
+		double total = 0, sum = 0;
+		__for__(auto v __in__ sv) total += v*v;
+		while (rank < full && sum < energy*total) { sum += sv[rank] * sv[rank]; rank++; }
+	}
+	if (rank < 1) rank = 1;
+	// no point if it isn't fewer multiplies
+	if (rank*(rows + cols) >= rows*cols) return 0;
+
+	const std::string low_name = std::string(layer_name) + "_low";
+	if (net.layer_map.count(low_name)) return 0;
+	model_rewrite m(net);
+	model_rewrite out;
+	for (int k = 0; k < (int)m.name.size(); k++)
+	{
+		if (m.name[k].compare(layer_name) == 0) out.add_layer(low_name, "fully_connected " + int2str(rank) + " identity", std::vector<float>(rank, 0.f));
+		out.add_layer(m.name[k], m.config[k], m.bias[k]);
+	}
+	for (int j = 0; j < (int)m.graph.size(); j++)
+	{
+		if (j != w_index) { out.add_connection(m.graph[j].first, m.graph[j].second, m.weights[j]); continue; }
+		// weights are one row per output: low is rank x cols, the layer is rows x rank
+		std::vector<float> a(rank*cols), b(rows*rank);
+		for (int r = 0; r < rank; r++)
+		{
+			const double root = std::sqrt(sv[r]);
+			for (int k = 0; k < cols; k++) a[r*cols + k] = (float)(root*vt[r*cols + k]);
+			for (int i = 0; i < rows; i++) b[i*rank + r] = (float)(root*u[i*full + r]);
+		}
+		out.add_connection(m.graph[j].first, low_name, a);
+		out.add_connection(low_name, layer_name, b);
+	}
+	if (!out.apply(net)) return 0;
+	return rank;
+}
+
+#ifndef NO_TRAINING_CODE
+// a few epochs of train_class over the samples (e.g. after factor_fully_connected). the network needs an optimizer
+inline void fine_tune(network &net, const std::vector<std::vector<float>> &samples, const std::vector<int> &labels,
+	const int epochs = 1, const char *loss_function = "mse")
+{
+	for (int e = 0; e < epochs; e++)
+	{
+		net.start_epoch(loss_function);
+		for (int k = 0; k < (int)samples.size(); k++) net.train_class((float *)samples[k].data(), labels[k]);
+		net.end_epoch();
+	}
+}
+#endif
+
+} // namespace
@@ -0,0 +1,166 @@
+// == ucnn ====================================================================
+//
+//    Copyright (c) gnawice@gnawice.com. All rights reserved.
+//	  See LICENSE in root folder
+//
+//    This file is part of ucnn.
+//
+//    uncc is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as published
+//    by the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    ucnn is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with ucnn.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+//    context.h: execution contexts for running one model from any number of threads
+//
+// ==================================================================== ucnn ==
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <thread>
+
+#include "network.h"
+
+namespace ucnn {
+
+//----------------------------------------------------------------------------------------------------------
+// C O N T E X T   P O O L
+// the network is the shared model and is only read. each caller takes an execution context (a copy of the
+// layers holding the per pass data, plus its compiled plan if the network was compiled) from a lock free pool,
+// so predictions need no thread index or allow_threads() and work from std::thread or any other thread pool.
+// contexts are made on first need and deleted again once idle for a while.
+// the model must not change while contexts are out. call clear() after changing it (training, read, ..)
+class context_pool
+{
+	const int CONTEXT_EMPTY = 0, CONTEXT_FREE = 1, CONTEXT_BUSY = 2;
+
+	struct context
+	{
+		std::vector<base_layer *> layers;
+		forward_plan plan;
+		bool compiled;
+		unsigned int last_used; // _clock at release
+		context() : compiled(false), last_used(0) {}
+		~context() { __for__(auto l __in__ layers) delete l; }
+	};
+
+	network &_net;
+	std::vector<context *> _contexts;
+	std::vector<std::atomic<int>> _state;
+	std::atomic<unsigned int> _clock; // counts releases
+	std::atomic<int> _built;
+
+	// the slot is BUSY and owned by the caller
+	void build(int i)
+	{
+		context *c = new context();
+		c->layers = _net.clone_layer_set();
+		if (!_net.plans.empty())
+		{
+			_net.compile_layer_set(c->layers, c->plan, _net.share_plan_activations);
+			c->compiled = true;
+		}
+		_contexts[i] = c;
+		_built++;
+	}
+
+	void destroy(int i)
+	{
+		delete _contexts[i];
+		_contexts[i] = NULL;
+		_built--;
+	}
+
+public:
+	// a context not used for idle_releases releases (by any thread) is deleted
+	unsigned int idle_releases;
+
+	context_pool(network &net, int max_contexts = 64, unsigned int idle = 10000) : _net(net), _contexts(max_contexts, NULL),
+		_state(max_contexts), _clock(0), _built(0), idle_releases(idle)
+	{
+		for (int i = 0; i < max_contexts; i++) _state[i] = CONTEXT_EMPTY;
+	}
+	~context_pool() { clear(); }
+
+	// deletes all contexts. none may be out
+	void clear()
+	{
+		for (int i = 0; i < (int)_contexts.size(); i++)
+			if (_contexts[i]) { destroy(i); _state[i] = CONTEXT_EMPTY; }
+	}
+
+	// contexts currently made (out or idle)
+	int contexts() const { return _built; }
+
+	// takes a context, reusing an idle one first (lowest slot, so higher ones go idle and get reclaimed),
+	// then making one in an empty slot. waits if all max_contexts are out
+	int acquire()
+	{
+		const int n = (int)_contexts.size();
+		while (true)
+		{
+			for (int i = 0; i < n; i++)
+			{
+				int expected = CONTEXT_FREE;
+				if (_state[i].load() == CONTEXT_FREE && _state[i].compare_exchange_strong(expected, CONTEXT_BUSY)) return i;
+			}
+			for (int i = 0; i < n; i++)
+			{
+				int expected = CONTEXT_EMPTY;
+				if (_state[i].load() == CONTEXT_EMPTY && _state[i].compare_exchange_strong(expected, CONTEXT_BUSY)) { build(i); return i; }
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	// gives a context back and reclaims one that has been idle too long (one slot checked per release)
+	void release(int i)
+	{
+		const unsigned int now = ++_clock;
+		_contexts[i]->last_used = now;
+		_state[i].store(CONTEXT_FREE);
+
+		const int r = (int)(now % _contexts.size());
+		int expected = CONTEXT_FREE;
+		if (_state[r].load() != CONTEXT_FREE || !_state[r].compare_exchange_strong(expected, CONTEXT_BUSY)) return;
+		if (now - _contexts[r]->last_used > idle_releases) { destroy(r); _state[r].store(CONTEXT_EMPTY); }
+		else _state[r].store(CONTEXT_FREE);
+	}
+
+	// forward pass in an acquired context. the pointer is valid until the context is released
+	float *forward(int i, const float *in)
+	{
+		context *c = _contexts[i];
+		if (c->compiled) return c->plan.run(in);
+		return _net.forward_layers(c->layers, in);
+	}
+
+	// forward pass copying out_size() floats to out
+	void forward(const float *in, float *out)
+	{
+		const int i = acquire();
+		const float *o = forward(i, in);
+		memcpy(out, o, sizeof(float)*_net.out_size());
+		release(i);
+	}
+
+	int predict_class(const float *in)
+	{
+		const int i = acquire();
+		const int c = max_index(forward(i, in), _net.out_size());
+		release(i);
+		return c;
+	}
+};
+
+} // namespace
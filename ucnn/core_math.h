@@ -31,6 +31,15 @@
 #include <string>
 #include <cstdlib>
 #include <random>
+#include <pmmintrin.h> // SSE3
+#include <vector>
+#include <atomic>
+#ifdef __F16C__
+#include <immintrin.h> // F16C half <-> float
+#endif
+#ifdef _MSC_VER
+#include <intrin.h> // __popcnt64
+#endif
 
 
 namespace ucnn
@@ -47,7 +56,19 @@ inline float dot(const float *x1, const float *x2, const int size)
 	case 5: return x1[0] * x2[0] + x1[1] * x2[1] + x1[2] * x2[2] + x1[3] * x2[3] + x1[4] * x2[4];
 	default:
 		float v = 0;
-		for (int i = 0; i<size; i++) v += x1[i] * x2[i];
+		int i = 0;
+#ifdef UCNN_SSE3
+		__m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+		for (; i + 8 <= size; i += 8)
+		{
+			a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(x1 + i), _mm_loadu_ps(x2 + i)));
+			a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(x1 + i + 4), _mm_loadu_ps(x2 + i + 4)));
+		}
+		a0 = _mm_add_ps(a0, a1);
+		a0 = _mm_hadd_ps(a0, a0);
+		v = _mm_cvtss_f32(_mm_hadd_ps(a0, a0));
+#endif
+		for (; i<size; i++) v += x1[i] * x2[i];
 		return v;
 	};
 }
@@ -316,6 +337,267 @@ inline float unwrap_2d_dot_rot180(const float *x1, const float *x2, const int si
 	return v;
 }
 
+#ifdef UCNN_SSE3
+// 4 wide exp(x), cephes style: exp(x) = 2^n * exp(r) with a 5th order polynomial for exp(r)
+// relative error is ~2e-7 over the clamped range
+inline __m128 exp_sse(__m128 x)
+{
+	x = _mm_min_ps(x, _mm_set1_ps(88.3762626647949f));
+	x = _mm_max_ps(x, _mm_set1_ps(-88.3762626647949f));
+
+	// n = floor(x*log2(e) + 0.5)
+	__m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f));
+	__m128 tmp = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+	fx = _mm_sub_ps(tmp, _mm_and_ps(_mm_cmpgt_ps(tmp, fx), _mm_set1_ps(1.f)));
+
+	// r = x - n*ln(2) in 2 parts to keep precision
+	x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(0.693359375f)));
+	x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(-2.12194440e-4f)));
+
+	__m128 y = _mm_set1_ps(1.9875691500E-4f);
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507E-3f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073E-3f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894E-2f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459E-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201E-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), _mm_add_ps(x, _mm_set1_ps(1.f)));
+
+	// build 2^n directly in the exponent bits
+	__m128i n = _mm_add_epi32(_mm_cvttps_epi32(fx), _mm_set1_epi32(0x7f));
+	return _mm_mul_ps(y, _mm_castsi128_ps(_mm_slli_epi32(n, 23)));
+}
+
+// horizontal sum / max of 4 lanes
+inline float hsum_sse(__m128 v) { v = _mm_hadd_ps(v, v); v = _mm_hadd_ps(v, v); return _mm_cvtss_f32(v); }
+inline float hmax_sse(__m128 v)
+{
+	v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+	v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+	return _mm_cvtss_f32(v);
+}
+#endif
+
+// max pooling ----------------------------------------------------
+// the pool map stores the position of the max inside its window as one byte: (row<<4)|col
+// so windows up to 16x16 are supported
+inline unsigned char pool_map_offset(const int jj, const int ii) { return (unsigned char)((jj << 4) | ii); }
+inline int pool_map_index(const unsigned char offset, const int jstep) { return (offset >> 4)*jstep + (offset & 0x0F); }
+
+#ifdef UCNN_SSE3
+// load 4 floats that are 'stride' apart
+inline __m128 load_strided_sse(const float *p, const int stride)
+{
+	if (stride == 1) return _mm_loadu_ps(p);
+	// p[0],p[2],p[4],p[6] - second load starts at p[3] so we never read past p[6]
+	if (stride == 2) return _mm_shuffle_ps(_mm_loadu_ps(p), _mm_loadu_ps(p + 3), _MM_SHUFFLE(3, 1, 2, 0));
+	return _mm_set_ps(p[3 * stride], p[2 * stride], p[stride], p[0]);
+}
+#endif
+
+// max pool a single output row. 'in' points to the top left of the first window, 'jstep' is the input row length
+// out[] gets the max and map[] the in-window offset of the max (first one wins on ties)
+inline void max_pool_row(const float *in, const int jstep, float *out, unsigned char *map, const int out_cols,
+	const int pool_x, const int pool_y, const int stride)
+{
+	int i = 0;
+#ifdef UCNN_SSE3
+	// 4 outputs at a time, argmax is kept as a float and blended in with the compare mask
+	for (; i + 4 <= out_cols; i += 4)
+	{
+		const float *base = in + i*stride;
+		__m128 vmax = load_strided_sse(base, stride);
+		__m128 vidx = _mm_setzero_ps();
+		for (int jj = 0; jj < pool_y; jj++)
+		{
+			for (int ii = 0; ii < pool_x; ii++)
+			{
+				if (jj == 0 && ii == 0) continue;
+				const __m128 v = load_strided_sse(base + jj*jstep + ii, stride);
+				const __m128 gt = _mm_cmpgt_ps(v, vmax);
+				vmax = _mm_max_ps(vmax, v);
+				vidx = _mm_or_ps(_mm_and_ps(gt, _mm_set1_ps((float)pool_map_offset(jj, ii))), _mm_andnot_ps(gt, vidx));
+			}
+		}
+		_mm_storeu_ps(out + i, vmax);
+		__m128i idx = _mm_cvttps_epi32(vidx);
+		idx = _mm_packs_epi32(idx, idx);
+		idx = _mm_packus_epi16(idx, idx);
+		const int packed = _mm_cvtsi128_si32(idx);
+		memcpy(map + i, &packed, 4);
+	}
+#endif
+	for (; i < out_cols; i++)
+	{
+		const float *base = in + i*stride;
+		float max = base[0];
+		unsigned char max_i = 0;
+		for (int jj = 0; jj < pool_y; jj++)
+		{
+			for (int ii = 0; ii < pool_x; ii++)
+			{
+				if (max < base[jj*jstep + ii]) { max = base[jj*jstep + ii]; max_i = pool_map_offset(jj, ii); }
+			}
+		}
+		out[i] = max;
+		map[i] = max_i;
+	}
+}
+
+// 16 bit weight storage -----------------------------------------
+// weights can be kept as fp16 or bf16 and are widened back to float inside the kernels
+const int PRECISION_FP32 = 0, PRECISION_FP16 = 1, PRECISION_BF16 = 2;
+
+inline int precision_from_name(const std::string &name)
+{
+	if (name.compare("fp16") == 0) return PRECISION_FP16;
+	if (name.compare("bf16") == 0) return PRECISION_BF16;
+	if (name.compare("fp32") == 0) return PRECISION_FP32;
+	return -1;
+}
+
+// round to nearest even
+inline unsigned short float_to_half(const float f)
+{
+#ifdef __F16C__
+	return (unsigned short)_cvtss_sh(f, 0);
+#else
+	unsigned int x; memcpy(&x, &f, 4);
+	const unsigned int sign = (x >> 16) & 0x8000;
+	const int e = (int)((x >> 23) & 0xff);
+	unsigned int mant = x & 0x7fffff;
+	if (e == 0xff) return (unsigned short)(sign | 0x7c00 | (mant ? 0x200 : 0)); // inf, nan
+	const int exp = e - 127 + 15;
+	if (exp >= 31) return (unsigned short)(sign | 0x7c00); // too big
+	if (exp <= 0) // subnormal half
+	{
+		if (exp < -10) return (unsigned short)sign;
+		mant |= 0x800000;
+		const int shift = 14 - exp;
+		unsigned int h = mant >> shift;
+		const unsigned int rem = mant & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+		if (rem > halfway || (rem == halfway && (h & 1))) h++;
+		return (unsigned short)(sign | h);
+	}
+	unsigned int h = ((unsigned int)exp << 10) | (mant >> 13);
+	const unsigned int rem = mant & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++; // a carry into the exponent is still correct
+	return (unsigned short)(sign | h);
+#endif
+}
+
+inline float half_to_float(const unsigned short h)
+{
+#ifdef __F16C__
+	return _cvtsh_ss(h);
+#else
+	const unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+	int exp = (h >> 10) & 0x1f;
+	unsigned int mant = h & 0x3ff;
+	unsigned int x;
+	if (exp == 0)
+	{
+		if (mant == 0) x = sign;
+		else // subnormal half is a normal float
+		{
+			exp = 1;
+			while (!(mant & 0x400)) { mant <<= 1; exp--; }
+			x = sign | ((unsigned int)(exp + 127 - 15) << 23) | ((mant & 0x3ff) << 13);
+		}
+	}
+	else if (exp == 31) x = sign | 0x7f800000 | (mant << 13);
+	else x = sign | ((unsigned int)(exp + 127 - 15) << 23) | (mant << 13);
+	float f; memcpy(&f, &x, 4);
+	return f;
+#endif
+}
+
+// bf16 is the top half of a float
+inline unsigned short float_to_bf16(const float f)
+{
+	unsigned int x; memcpy(&x, &f, 4);
+	if ((x & 0x7fffffff) > 0x7f800000) return (unsigned short)((x >> 16) | 0x40); // keep nan a nan
+	x += 0x7fff + ((x >> 16) & 1);
+	return (unsigned short)(x >> 16);
+}
+inline float bf16_to_float(const unsigned short h)
+{
+	const unsigned int x = (unsigned int)h << 16;
+	float f; memcpy(&f, &x, 4);
+	return f;
+}
+// bf16 rounded up with the probability of the dropped fraction, so many small changes add up on average
+// instead of rounding away. the low 16 bits of r are the random draw. no nan/inf care
+inline unsigned short float_to_bf16_stochastic(const float f, const unsigned int r)
+{
+	unsigned int x; memcpy(&x, &f, 4);
+	return (unsigned short)((x + (r & 0xffff)) >> 16);
+}
+
+inline float widen(const unsigned short h, const int precision) { return precision == PRECISION_BF16 ? bf16_to_float(h) : half_to_float(h); }
+inline unsigned short narrow(const float f, const int precision) { return precision == PRECISION_BF16 ? float_to_bf16(f) : float_to_half(f); }
+
+#ifdef UCNN_SSE3
+// 4 fp16 values (low 16 bits of each lane) to float without F16C: move exponent/mantissa into place
+// and rescale the exponent with one multiply (handles subnormals), then patch inf/nan and the sign
+inline __m128 half_to_float_sse(const __m128i h)
+{
+	const __m128i em = _mm_and_si128(h, _mm_set1_epi32(0x7fff));
+	__m128 f = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(em, 13)), _mm_castsi128_ps(_mm_set1_epi32(0x77800000))); // * 2^112
+	const __m128i infnan = _mm_cmpgt_epi32(em, _mm_set1_epi32(0x7bff));
+	f = _mm_or_ps(f, _mm_castsi128_ps(_mm_and_si128(infnan, _mm_set1_epi32(0x7f800000))));
+	return _mm_or_ps(f, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16)));
+}
+
+// float_to_bf16_stochastic of 4 values, packed into the low 64 bits
+inline __m128i float_to_bf16_stochastic_sse(const __m128 f, const __m128i r)
+{
+	// arithmetic shift keeps the top halves in signed 16 bit range for the saturating pack
+	const __m128i h = _mm_srai_epi32(_mm_add_epi32(_mm_castps_si128(f), _mm_and_si128(r, _mm_set1_epi32(0xffff))), 16);
+	return _mm_packs_epi32(h, h);
+}
+#endif
+
+// dot of float x with 16 bit w. bf16 widens with an interleave against zero, fp16 with F16C (or the sse fallback above)
+inline float dot_half(const float *x, const unsigned short *w, const int size, const int precision)
+{
+	int i = 0;
+	float v = 0;
+#ifdef UCNN_SSE3
+	__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+	if (precision == PRECISION_BF16)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 8 <= size; i += 8)
+		{
+			const __m128i h = _mm_loadu_si128((const __m128i*)(w + i));
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_castsi128_ps(_mm_unpacklo_epi16(zero, h))));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_castsi128_ps(_mm_unpackhi_epi16(zero, h))));
+		}
+	}
+	else
+	{
+#ifndef __F16C__
+		const __m128i zero = _mm_setzero_si128();
+#endif
+		for (; i + 8 <= size; i += 8)
+		{
+			const __m128i h = _mm_loadu_si128((const __m128i*)(w + i));
+#ifdef __F16C__
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_cvtph_ps(h)));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_cvtph_ps(_mm_unpackhi_epi64(h, h))));
+#else
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i), half_to_float_sse(_mm_unpacklo_epi16(h, zero))));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), half_to_float_sse(_mm_unpackhi_epi16(h, zero))));
+#endif
+		}
+	}
+	v = hsum_sse(_mm_add_ps(acc0, acc1));
+#endif
+	if (precision == PRECISION_BF16) for (; i < size; i++) v += x[i] * bf16_to_float(w[i]);
+	else for (; i < size; i++) v += x[i] * half_to_float(w[i]);
+	return v;
+}
+
 // matrix class ---------------------------------------------------
 // should use opencv if available
 //
@@ -323,23 +605,24 @@ class matrix
 {
 	int _size;
 	int _capacity;
+	bool _owner; // false for a view (see view())
 public:
 	std::string _name;
 	int cols, rows, chans;
 	float *x;
 
-	matrix( ): cols(0), rows(0), chans(0), _size(0), _capacity(0), x(NULL)  {} 
+	matrix( ): cols(0), rows(0), chans(0), _size(0), _capacity(0), _owner(true), x(NULL)  {} 
 
-	matrix( int _w, int _h, int _c=1, float *data=NULL): cols(_w), rows(_h), chans(_c) 
+	matrix( int _w, int _h, int _c=1, float *data=NULL): _owner(true), cols(_w), rows(_h), chans(_c) 
 	{
 		_size=cols*rows*chans; _capacity=_size; x = new float[_size]; 
 		if(data!=NULL) memcpy(x,data,_size*sizeof(float));
 	}
 
 	// copy constructor - deep copy
-	matrix( const matrix &m) : cols(m.cols), rows(m.rows), chans(m.chans), _size(m._size), _capacity(m._size)   {x = new float[_size]; memcpy(x,m.x,sizeof(float)*_size); } // { v=m.v; x=(float*)v.data();}
+	matrix( const matrix &m) : cols(m.cols), rows(m.rows), chans(m.chans), _size(m._size), _capacity(m._size), _owner(true)   {x = new float[_size]; memcpy(x,m.x,sizeof(float)*_size); } // { v=m.v; x=(float*)v.data();}
 	// copy and pad constructor
-	matrix( const matrix &m, int pad_cols, int pad_rows) : cols(m.cols+2*pad_cols), rows(m.rows+2*pad_rows), chans(m.chans)
+	matrix( const matrix &m, int pad_cols, int pad_rows) : _owner(true), cols(m.cols+2*pad_cols), rows(m.rows+2*pad_rows), chans(m.chans)
 	{
 		_size = cols*rows*chans;
 		_capacity = _size;
@@ -353,7 +636,7 @@ public:
 		 
 	} // { v=m.v; x=(float*)v.data();}
 
-	~matrix() { if(x) delete [] x; x=NULL;}
+	~matrix() { if(x && _owner) delete [] x; x=NULL;}
 	
 	matrix get_chan(int channel) const
 	{
@@ -506,10 +789,34 @@ public:
 	}
 
 	int  size() const {return _size;} 
+
+	// moves the data to data, memory owned by someone else (see float_arena), and keeps pointing there.
+	// resizing past the current size gives the matrix its own memory again
+	void view(float *data)
+	{
+		if(_size) memcpy(data,x,sizeof(float)*_size);
+		if(x && _owner) delete [] x;
+		x=data; _capacity=_size; _owner=false;
+	}
+	bool is_view() const {return !_owner;}
+	// a view of m's data in place of its own, for copies that only read it
+	void share(const matrix &m)
+	{
+		if(x && _owner) delete [] x;
+		cols=m.cols; rows=m.rows; chans=m.chans; _size=m._size;
+		x=m.x; _capacity=_size; _owner=false;
+	}
+	// back to (zeroed) memory of its own after view()
+	void own()
+	{
+		if(_owner) return;
+		x = new float[_size]; _capacity=_size; _owner=true;
+		memset(x,0,sizeof(float)*_size);
+	}
 	
 	void resize(int _w, int _h, int _c) { 
 		int s = _w*_h*_c;
-		if(s>_capacity) { if(_capacity>0) delete [] x; _size = s; _capacity=_size; x = new float[_size];}
+		if(s>_capacity) { if(_capacity>0 && _owner) delete [] x; _size = s; _capacity=_size; x = new float[_size]; _owner=true;}
 		cols=_w; rows=_h; chans=_c; _size=s;
 	} 
 	
@@ -552,5 +859,278 @@ public:
 	}
 };
 
+// one 64 byte aligned block of floats that a list of matrices is laid out in, back to back and each starting
+// on a 64 byte boundary. pack() moves their data in and leaves them as views, so the whole list can be zeroed,
+// stepped, written or sent as one range. the matrices must be deleted or packed again before the arena is
+class float_arena
+{
+	float *_block; // as allocated
+	float *_x;     // _block rounded up to 64 bytes
+	size_t _size;
+	float_arena(const float_arena &);
+	float_arena &operator=(const float_arena &);
+public:
+	float_arena() : _block(NULL), _x(NULL), _size(0) {}
+	~float_arena() { clear(); }
+
+	// floats a matrix of n takes, padding included
+	static size_t padded(size_t n) { return (n + 15) & ~(size_t)15; }
+
+	void clear() { if (_block) delete[] _block; _block = NULL; _x = NULL; _size = 0; }
+	// a new zeroed block of n, for callers keeping their own layout
+	void allocate(size_t n)
+	{
+		clear();
+		_block = new float[n + 16];
+		_x = (float *)(((size_t)_block + 63) & ~(size_t)63);
+		_size = n;
+		memset(_x, 0, sizeof(float)*n);
+	}
+	float *data() { return _x; }
+	size_t size() const { return _size; }
+	bool contains(const matrix &m) const { return m.is_view() && _x && m.x >= _x && m.x < _x + _size; }
+	void fill(float v) { for (size_t i = 0; i < _size; i++) _x[i] = v; }
+
+	// lays m out in list order, in a new block (contents kept, padding zero). empty matrices are left alone
+	void pack(const std::vector<matrix *> &m)
+	{
+		size_t n = 0;
+		for (size_t i = 0; i < m.size(); i++) n += padded(m[i]->size());
+		float *block = new float[n + 16];
+		float *x = (float *)(((size_t)block + 63) & ~(size_t)63);
+		memset(x, 0, sizeof(float)*n);
+		for (size_t i = 0, at = 0; i < m.size(); at += padded(m[i]->size()), i++)
+			if (m[i]->size()) m[i]->view(x + at);
+		clear();
+		_block = block; _x = x; _size = n;
+	}
+};
+
+
+// 16 bit copy of a weight matrix. same shape as the float one
+class half_matrix
+{
+public:
+	int cols, rows, chans;
+	int precision;
+	std::vector<unsigned short> x;
+
+	half_matrix(const matrix &m, const int _precision) { from(m, _precision); }
+
+	int size() const { return (int)x.size(); }
+
+	void from(const matrix &m, const int _precision)
+	{
+		cols = m.cols; rows = m.rows; chans = m.chans; precision = _precision;
+		x.resize(m.size());
+		for (int i = 0; i < m.size(); i++) x[i] = narrow(m.x[i], precision);
+	}
+
+	void widen(matrix &m) const
+	{
+		m.resize(cols, rows, chans);
+		for (int i = 0; i < size(); i++) m.x[i] = ucnn::widen(x[i], precision);
+	}
+
+	// out += v * this, same layout as matrix::dot_1dx2d. optionally only rows [begin, end)
+	inline void dot_1dx2d_add(const float *v, float *out, int begin = 0, int end = -1) const
+	{
+		const unsigned short *w = x.data();
+		if (end < 0) end = rows;
+		for (int j = begin; j < end; j++) out[j] += dot_half(v, w + j*cols, cols, precision);
+	}
+};
+
+// 4x4 block sparse copy of a fully connected weight matrix (rows = outputs, cols = inputs)
+// only blocks with a non zero are kept. blocks hanging over the right/bottom edge are zero padded
+class block_sparse_matrix
+{
+public:
+	int cols, rows;
+	std::vector<int> row_start; // first block of each block row, block_rows()+1 entries
+	std::vector<int> block_col; // first column of each block
+	std::vector<float> val;     // 16 floats per block, row major
+
+	block_sparse_matrix(int _cols, int _rows) : cols(_cols), rows(_rows) { row_start.assign(block_rows() + 1, 0); }
+	block_sparse_matrix(const matrix &m) { from(m); }
+
+	int block_rows() const { return (rows + 3) / 4; }
+	int blocks() const { return (int)block_col.size(); }
+
+	// fraction of 4x4 blocks that have a non zero
+	static float block_density(const matrix &m)
+	{
+		const int br = (m.rows + 3) / 4, bc = (m.cols + 3) / 4;
+		if (br*bc == 0) return 1.f;
+		int used = 0;
+		for (int r = 0; r < br; r++)
+			for (int c = 0; c < bc; c++)
+			{
+				bool nz = false;
+				for (int j = r * 4; j < r * 4 + 4 && j < m.rows && !nz; j++)
+					for (int i = c * 4; i < c * 4 + 4 && i < m.cols; i++) if (m.x[i + j*m.cols] != 0) { nz = true; break; }
+				if (nz) used++;
+			}
+		return (float)used / (float)(br*bc);
+	}
+
+	void from(const matrix &m)
+	{
+		cols = m.cols; rows = m.rows;
+		row_start.assign(1, 0); block_col.clear(); val.clear();
+		float b[16];
+		for (int r = 0; r < block_rows(); r++)
+		{
+			for (int c = 0; c < cols; c += 4)
+			{
+				bool nz = false;
+				for (int jj = 0; jj < 4; jj++)
+					for (int ii = 0; ii < 4; ii++)
+					{
+						const int j = r * 4 + jj, i = c + ii;
+						b[jj * 4 + ii] = (j < rows && i < cols) ? m.x[i + j*cols] : 0.f;
+						if (b[jj * 4 + ii] != 0) nz = true;
+					}
+				if (!nz) continue;
+				block_col.push_back(c);
+				val.insert(val.end(), b, b + 16);
+			}
+			row_start.push_back((int)block_col.size());
+		}
+	}
+
+	void to_dense(matrix &m) const
+	{
+		m.resize(cols, rows, 1);
+		m.fill(0);
+		for (int r = 0; r < block_rows(); r++)
+			for (int k = row_start[r]; k < row_start[r + 1]; k++)
+				for (int jj = 0; jj < 4; jj++)
+					for (int ii = 0; ii < 4; ii++)
+					{
+						const int j = r * 4 + jj, i = block_col[k] + ii;
+						if (j < rows && i < cols) m.x[i + j*cols] = val[k * 16 + jj * 4 + ii];
+					}
+	}
+
+	// out += v * this, same layout as matrix::dot_1dx2d. optionally only block rows [begin, end)
+	inline void dot_1dx2d_add(const float *v, float *out, int begin = 0, int end = -1) const
+	{
+		const float *w = val.data();
+		if (end < 0) end = block_rows();
+		for (int r = begin; r < end; r++)
+		{
+			float o[4];
+#ifdef UCNN_SSE3
+			__m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+			for (int k = row_start[r]; k < row_start[r + 1]; k++)
+			{
+				const int c = block_col[k];
+				__m128 x;
+				if (c + 4 <= cols) x = _mm_loadu_ps(v + c);
+				else { float t[4] = { 0, 0, 0, 0 }; memcpy(t, v + c, (cols - c)*sizeof(float)); x = _mm_loadu_ps(t); }
+				const float *b = w + k * 16;
+				a0 = _mm_add_ps(a0, _mm_mul_ps(x, _mm_loadu_ps(b)));
+				a1 = _mm_add_ps(a1, _mm_mul_ps(x, _mm_loadu_ps(b + 4)));
+				a2 = _mm_add_ps(a2, _mm_mul_ps(x, _mm_loadu_ps(b + 8)));
+				a3 = _mm_add_ps(a3, _mm_mul_ps(x, _mm_loadu_ps(b + 12)));
+			}
+			// lane j of the result is the sum of aj
+			_mm_storeu_ps(o, _mm_hadd_ps(_mm_hadd_ps(a0, a1), _mm_hadd_ps(a2, a3)));
+#else
+			o[0] = o[1] = o[2] = o[3] = 0;
+			for (int k = row_start[r]; k < row_start[r + 1]; k++)
+			{
+				const int c = block_col[k];
+				const float *b = w + k * 16;
+				for (int ii = 0; ii < 4 && c + ii < cols; ii++)
+					for (int jj = 0; jj < 4; jj++) o[jj] += v[c + ii] * b[jj * 4 + ii];
+			}
+#endif
+			for (int jj = 0; jj < 4 && r * 4 + jj < rows; jj++) out[r * 4 + jj] += o[jj];
+		}
+	}
+};
+
+//----------------------------------------------------------------------------------------------------------
+// binary (sign) weights and activations, packed 64 per word. a set bit means negative, sign(0) is +1
+// the dot product of two {-1,1} vectors of n bits is n - 2*popcount(a^b). unused tail bits are zero in both
+
+inline int popcount64(const unsigned long long v)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	return (int)__popcnt64(v);
+#elif defined(__GNUC__)
+	return __builtin_popcountll(v);
+#else
+	unsigned long long x = v - ((v >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+inline int binary_words(const int bits) { return (bits + 63) / 64; }
+inline float binary_sign(const float v) { return v < 0 ? -1.f : 1.f; }
+
+// number of differing bits over n words
+inline int popcount_xor(const unsigned long long *a, const unsigned long long *b, const int n)
+{
+	int c0 = 0, c1 = 0;
+	int i = 0;
+	for (; i + 2 <= n; i += 2) { c0 += popcount64(a[i] ^ b[i]); c1 += popcount64(a[i + 1] ^ b[i + 1]); }
+	if (i < n) c0 += popcount64(a[i] ^ b[i]);
+	return c0 + c1;
+}
+
+// packs sign bits of v[0..size) into binary_words(size) words
+inline void pack_signs(const float *v, const int size, unsigned long long *out)
+{
+	const int n = binary_words(size);
+	for (int w = 0; w < n; w++)
+	{
+		unsigned long long b = 0;
+		const int end = size - w * 64 < 64 ? size - w * 64 : 64;
+		for (int i = 0; i < end; i++) if (v[w * 64 + i] < 0) b |= 1ULL << i;
+		out[w] = b;
+	}
+}
+
+// sign packed copy of a weight matrix, one row of words per output with a per row scale alpha (mean |w|)
+// so row r stands for alpha[r]*sign(w). bits is the length of the {-1,1} vector a row is dotted with
+class binary_matrix
+{
+public:
+	int rows, words, bits;
+	std::vector<unsigned long long> x;
+	std::vector<float> alpha;
+	// set by the packers after each (re)pack to an id no other pack has, so copies made from it can tell
+	// they are stale
+	std::atomic<unsigned int> pack_id;
+
+	binary_matrix() : rows(0), words(0), bits(0), pack_id(0) {}
+
+	static unsigned int next_pack_id() { static std::atomic<unsigned int> id(0); return ++id; }
+
+	// packers overwrite every word and alpha, so a repack of the same shape keeps the storage as it is.
+	// a forward reading it meanwhile (staleness, hogwild) sees old or new words, never cleared ones
+	void resize(const int _words, const int _rows, const int _bits)
+	{
+		if (rows == _rows && words == _words && bits == _bits) return;
+		rows = _rows; words = _words; bits = _bits;
+		x.assign(rows*words, 0);
+		alpha.assign(rows, 0.f);
+	}
+
+	unsigned long long *row(const int r) { return &x[r*words]; }
+	const unsigned long long *row(const int r) const { return &x[r*words]; }
+
+	// out[r] += alpha[r] * (row r . in) for in packed the same way
+	inline void dot_add(const unsigned long long *in, float *out) const
+	{
+		for (int r = 0; r < rows; r++) out[r] += alpha[r] * (float)(bits - 2 * popcount_xor(in, row(r), words));
+	}
+};
+
 }// namespace
 
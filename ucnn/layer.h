@@ -53,14 +53,37 @@ public:
 	std::string name;
 	// index of W matrix, index of connected layer
 	std::vector<std::pair<int,base_layer*>> forward_linked_layers;
+	matrix _w_scratch; // only used when weights are stored as 16 bit or sparse
 #ifndef NO_TRAINING_CODE
 	matrix delta;
 	std::vector<std::pair<int,base_layer*>> backward_linked_layers;
 
 	virtual void distribute_delta(base_layer &top, const matrix &w, const int train = 1) =0;
+	// binary layers (binary_*) go back through the packed weights their forward used. w gives the shape
+	virtual void distribute_delta_binary(base_layer &top, const matrix &w, const binary_matrix &packed, const int train = 1) { distribute_delta(top, w, train); }
+	// adds this sample's weight gradient to dw, which is sized like the weights. samples accumulate in place
 	virtual void calculate_dw(const base_layer &top_layer, matrix &dw, const int train =1)=0;
 #endif
 	virtual void accumulate_signal(const base_layer &top_node, const matrix &w, const int train =0) =0;
+	// weights kept as fp16/bf16. the default widens them into a scratch matrix first,
+	// layers that are bandwidth bound (fully connected) widen in registers instead
+	virtual void accumulate_signal_half(const base_layer &top_node, const half_matrix &w, const int train =0)
+	{
+		w.widen(_w_scratch);
+		accumulate_signal(top_node, _w_scratch, train);
+	}
+	// block sparse weights (only made for fully connected layers)
+	virtual void accumulate_signal_sparse(const base_layer &top_node, const block_sparse_matrix &w, const int train =0)
+	{
+		w.to_dense(_w_scratch);
+		accumulate_signal(top_node, _w_scratch, train);
+	}
+	// sign binarized layers (binary_*). the network keeps a packed copy of their weights made by pack_weights
+	virtual bool binary_weights() { return false; }
+	virtual void pack_weights(const matrix &w, binary_matrix &packed) {}
+	virtual void accumulate_signal_binary(const base_layer &top_node, const binary_matrix &w, const int train =0) {}
+	// pass through layers (dropout) return the factor they scale their input by at inference. 0 for all others
+	virtual float inference_scale() { return 0.f; }
 
 	base_layer(const char* layer_name, int _w, int _h=1, int _c=1) : node(_w, _h, _c), bias(_w, _h, _c), p_act(NULL), name(layer_name), pad_cols(0), pad_rows(0)
 		#ifndef NO_TRAINING_CODE
@@ -128,13 +151,21 @@ public:
 	{
 		// doesn't care if shape is not 1D
 		// here weights are formated in matrix, top node in cols, bottom node along rows. (note that my top is opposite of traditional understanding)
-		node += top.node.dot_1dx2d(w);
-//		const int s = w.rows;
-//		const int ts = top.node.size();
-//		for (int j = 0; j<s; j++)	
-//			node.x[j] += dot(top.node.x, w.x+j*w.cols, ts);
+		// same as node += top.node.dot_1dx2d(w) without the temporary
+		const int s = w.rows;
+		const int ts = top.node.size();
+		for (int j = 0; j<s; j++)	
+			node.x[j] += dot(top.node.x, w.x+j*w.cols, ts);
 
 	}
+	virtual void accumulate_signal_half(const base_layer &top, const half_matrix &w, const int train =0)
+	{
+		w.dot_1dx2d_add(top.node.x, node.x);
+	}
+	virtual void accumulate_signal_sparse(const base_layer &top, const block_sparse_matrix &w, const int train =0)
+	{
+		w.dot_1dx2d_add(top.node.x, node.x);
+	}
 #ifndef NO_TRAINING_CODE
 	virtual void distribute_delta(base_layer &top, const matrix &w, const int train =1)
 	{
@@ -150,18 +181,97 @@ public:
 	{
 		const float *bottom = delta.x; const int sizeb = delta.size();
 		const float *top = top_layer.node.x; const int sizet = top_layer.node.size();
-		dw.resize(sizet, sizeb, 1);
 
 		for (int b = 0; b < sizeb; b++)
 		{
 			const float cb = bottom[b];
-			for (int t = 0; t < sizet; t++)	dw.x[t + b*sizet] = top[t] * cb;
+			for (int t = 0; t < sizet; t++)	dw.x[t + b*sizet] += top[t] * cb;
 		}
 	}
 #endif
 
 };
 
+//----------------------------------------------------------------------------------------------------------
+// B I N A R Y   F U L L Y   C O N N E C T E D
+//
+// runs as sign(input) . alpha*sign(w) with xnor/popcount. alpha is the mean |w| of each output row.
+// W keeps the float (latent) weights for training: gradients go straight through the sign functions,
+// and only reach inputs with |x|<=1. feed it from tanh (or other [-1,1]) layers
+class binary_fully_connected_layer : public base_layer
+{
+	binary_matrix _packed; // only used when given float weights
+	const float *_packed_from; // the weights _packed holds at inference, NULL when made while training
+	std::vector<unsigned long long> _in_bits;
+	std::vector<float> _alpha; // weight scales from the last distribute_delta
+	std::vector<float> _pass; // 1 for inputs with |x|<=1 that the gradient goes through, else 0
+public:
+	binary_fully_connected_layer(const char *layer_name, int _size, activation_function *p ) : base_layer(layer_name,_size,1,1), _packed_from(NULL)  {p_act=p; }
+	virtual std::string get_config_string() {std::string str="binary_fully_connected "+int2str(node.size())+ " "+p_act->name+"\n"; return str;}
+	virtual bool binary_weights() { return true; }
+	virtual void pack_weights(const matrix &w, binary_matrix &packed)
+	{
+		packed.resize(binary_words(w.cols), w.rows, w.cols);
+		for (int j = 0; j < w.rows; j++)
+		{
+			const float *r = w.x + j*w.cols;
+			float a = 0;
+			for (int i = 0; i < w.cols; i++) a += std::fabs(r[i]);
+			packed.alpha[j] = a / (float)w.cols;
+			pack_signs(r, w.cols, packed.row(j));
+		}
+		packed.pack_id = binary_matrix::next_pack_id();
+	}
+	// float weights are packed once for inference, and every call while training as they move
+	virtual void accumulate_signal( const base_layer &top,const matrix &w, const int train =0)
+	{
+		if (train || _packed_from != w.x || _packed.rows != w.rows) { pack_weights(w, _packed); _packed_from = train ? NULL : w.x; }
+		accumulate_signal_binary(top, _packed, train);
+	}
+	virtual void accumulate_signal_binary(const base_layer &top, const binary_matrix &w, const int train =0)
+	{
+		_in_bits.resize(w.words);
+		pack_signs(top.node.x, top.node.size(), _in_bits.data());
+		w.dot_add(_in_bits.data(), node.x);
+	}
+#ifndef NO_TRAINING_CODE
+	virtual void distribute_delta(base_layer &top, const matrix &w, const int train =1)
+	{
+		pack_weights(w, _packed); _packed_from = NULL;
+		distribute_delta_binary(top, w, _packed, train);
+	}
+	// the scales come with the packed rows. the signs are read from w, which is what they were packed from,
+	// in one branch free pass that vectorizes
+	virtual void distribute_delta_binary(base_layer &top, const matrix &w, const binary_matrix &packed, const int train =1)
+	{
+		const int w_cols = w.cols;
+		_alpha.assign(packed.alpha.begin(), packed.alpha.end());
+		_pass.resize(w_cols);
+		for (int t = 0; t < w_cols; t++) _pass[t] = std::fabs(top.node.x[t]) <= 1.f ? 1.f : 0.f;
+		const float *pass = _pass.data();
+		float *d = top.delta.x;
+		for (int b = 0; b < w.rows; b++)
+		{
+			const float *r = w.x + b*w_cols;
+			const float cb = delta.x[b] * _alpha[b];
+			for (int t = 0; t < w_cols; t++) d[t] += pass[t] * (r[t] < 0 ? -cb : cb);
+		}
+	}
+
+	virtual void calculate_dw(const base_layer &top_layer, matrix &dw, const int train = 1)
+	{
+		const float *bottom = delta.x; const int sizeb = delta.size();
+		const float *top = top_layer.node.x; const int sizet = top_layer.node.size();
+
+		for (int b = 0; b < sizeb; b++)
+		{
+			const float cb = bottom[b] * _alpha[b];
+			for (int t = 0; t < sizet; t++)	dw.x[t + b*sizet] += binary_sign(top[t]) * cb;
+		}
+	}
+#endif
+};
+
 //----------------------------------------------------------------------------------------------------------
 // M A X   P O O L I N G   
 // 
@@ -171,8 +281,13 @@ class max_pooling_layer : public base_layer
 	int _pool_size;
 	int _stride;
 	// uses a map to connect pooled result to top layer
-	std::vector<int> _max_map;
+	// one byte per output holding the position of the max inside its pooling window (see pool_map_offset)
+	std::vector<unsigned char> _max_map;
 public:
+	// window is clipped to the input for 1D or very small inputs
+	int pool_rows(const base_layer &top) const { return top.node.rows<_pool_size ? top.node.rows : _pool_size; }
+	int pool_cols(const base_layer &top) const { return top.node.cols<_pool_size ? top.node.cols : _pool_size; }
+	int stride() const { return _stride; }
 	max_pooling_layer(const char *layer_name, int pool_size, activation_function *p = NULL) : base_layer(layer_name, 1)
 	{
 		p_act = p; _stride = pool_size; _pool_size = pool_size; p_act = new_activation_function("identity"); //layer_type=pool_type;
@@ -220,93 +335,24 @@ public:
 	// this is downsampling
 	virtual void accumulate_signal(const base_layer &top,const matrix &w,const int train =0)
 	{
-		int kstep=top.node.cols*top.node.rows;
-		int jstep=top.node.cols;
-		int output_index=0;
-		int *p_map = _max_map.data();
-		int pool_y=_pool_size; if(top.node.rows==1) pool_y=1; //-top.pad_rows*2==1) pool_y=1;
-		int pool_x=_pool_size; if(top.node.cols==1) pool_x=1;//-top.pad_cols*2==1) pool_x=1;
-		const float *top_node = top.node.x;
-		for(int k=0; k<top.node.chans; k++)
+		const int kstep=top.node.cols*top.node.rows;
+		const int jstep=top.node.cols;
+		const int map_size=node.cols*node.rows;
+		const int pool_y=pool_rows(top);
+		const int pool_x=pool_cols(top);
+		unsigned char *p_map = _max_map.data();
+		for(int k=0; k<node.chans; k++)
 		{
-			
-			for(int j=0; j<=top.node.rows- _pool_size; j+= _stride)
+			for(int j=0; j<node.rows; j++)
 			{
-				for(int i=0; i<=top.node.cols- _pool_size; i+= _stride)
-				{
-					const int base_index=i+(j)*jstep+k*kstep;
-					int max_i=base_index;
-					float max=top_node[base_index];
-					
-					if(pool_x==2)
-					{
-						const float *n=top_node+base_index;
-						//if(max<n[0]) { max = n[0]; max_i=max_i;}
-						if(max<n[1]) { max = n[1]; max_i=base_index+1;}
-						n+=jstep;
-						if(max<n[0]) { max = n[0]; max_i=base_index+jstep;}
-						if(max<n[1]) { max = n[1]; max_i=base_index+jstep+1;}
-
-					}
-					else if(pool_x==3)
-					{
-						const float *n=top_node+base_index;
-						//if(max<n[0]) { max = n[0]; max_i=max_i;}
-						if(max<n[1]) { max = n[1]; max_i=base_index+1;}
-						if(max<n[2]) { max = n[2]; max_i=base_index+2;}
-						n+=jstep;
-						if(max<n[0]) { max = n[0]; max_i=base_index+jstep;}
-						if(max<n[1]) { max = n[1]; max_i=base_index+jstep+1;}
-						if(max<n[2]) { max = n[2]; max_i=base_index+jstep+2;}
-						n+=jstep;
-						if(max<n[0]) { max = n[0]; max_i=base_index+2*jstep;}
-						if(max<n[1]) { max = n[1]; max_i=base_index+2*jstep+1;}
-						if(max<n[2]) { max = n[2]; max_i=base_index+2*jstep+2;}
-					}
-					else if(pool_x==4)
-					{
-						const float *n=top_node+base_index;
-						//if(max<n[0]) { max = n[0]; max_i=max_i;}
-						if(max<n[1]) { max = n[1]; max_i=base_index+1;}
-						if(max<n[2]) { max = n[2]; max_i=base_index+2;}
-						if(max<n[3]) { max = n[3]; max_i=base_index+3;}
-						n+=jstep;
-						if(max<n[0]) { max = n[0]; max_i=base_index+jstep;}
-						if(max<n[1]) { max = n[1]; max_i=base_index+jstep+1;}
-						if(max<n[2]) { max = n[2]; max_i=base_index+jstep+2;}
-						if(max<n[3]) { max = n[3]; max_i=base_index+jstep+3;}
-						n+=jstep;
-						if(max<n[0]) { max = n[0]; max_i=base_index+2*jstep;}
-						if(max<n[1]) { max = n[1]; max_i=base_index+2*jstep+1;}
-						if(max<n[2]) { max = n[2]; max_i=base_index+2*jstep+2;}
-						if(max<n[3]) { max = n[3]; max_i=base_index+2*jstep+3;}
-						n+=jstep;
-						if(max<n[0]) { max = n[0]; max_i=base_index+3*jstep;}
-						if(max<n[1]) { max = n[1]; max_i=base_index+3*jstep+1;}
-						if(max<n[2]) { max = n[2]; max_i=base_index+3*jstep+2;}
-						if(max<n[3]) { max = n[3]; max_i=base_index+3*jstep+3;}
-					}
-					else
-					
-					{
-						// speed up with optimized size version
-						for(int jj=0; jj<pool_y; jj+= _stride)
-						{
-							for(int ii=0; ii<pool_x; ii+= _stride)
-							{
-								int index=i+ii+(j+jj)*jstep+k*kstep;
-								if(max<top_node[index])
-								{
-									max = top_node[index];
-									max_i=index;
-								}
-							}
-						}
-					}
-					node.x[output_index]=max;
-					p_map[output_index]=max_i;
-					output_index++;	
-				}
+				const float *in=top.node.x+j*_stride*jstep+k*kstep;
+				const int output_index=j*node.cols+k*map_size;
+				// constant sizes so the common cases get unrolled
+				if(pool_x==2 && pool_y==2 && _stride==2) max_pool_row(in, jstep, node.x+output_index, p_map+output_index, node.cols, 2, 2, 2);
+				else if(pool_x==3 && pool_y==3 && _stride==2) max_pool_row(in, jstep, node.x+output_index, p_map+output_index, node.cols, 3, 3, 2);
+				else if(pool_x==3 && pool_y==3 && _stride==3) max_pool_row(in, jstep, node.x+output_index, p_map+output_index, node.cols, 3, 3, 3);
+				else if(pool_x==4 && pool_y==4 && _stride==4) max_pool_row(in, jstep, node.x+output_index, p_map+output_index, node.cols, 4, 4, 4);
+				else max_pool_row(in, jstep, node.x+output_index, p_map+output_index, node.cols, pool_x, pool_y, _stride);
 			}
 		}
 	}
@@ -315,9 +361,20 @@ public:
 	// this is upsampling
 	virtual void distribute_delta(base_layer &top, const matrix &w, const int train =1)
 	{
-		int *p_map = _max_map.data();
-		for(int k=0; k<(int)_max_map.size(); k++) 
-			top.delta.x[p_map[k]]+=delta.x[k];
+		const int kstep=top.delta.cols*top.delta.rows;
+		const int jstep=top.delta.cols;
+		const unsigned char *p_map = _max_map.data();
+		const float *_delta = delta.x;
+		for(int k=0; k<node.chans; k++)
+		{
+			for(int j=0; j<node.rows; j++)
+			{
+				float *t=top.delta.x+j*_stride*jstep+k*kstep;
+				for(int i=0; i<node.cols; i++)
+					t[i*_stride+pool_map_index(p_map[i], jstep)]+=_delta[i];
+				p_map+=node.cols; _delta+=node.cols;
+			}
+		}
 	}
 #endif
 };
@@ -346,6 +403,8 @@ public:
 	}
 
 	virtual void activate_nodes() { return; }
+	// a plain copy when not training
+	virtual float inference_scale() { return 1.f; }
 	// no weights 
 	virtual void calculate_dw(const base_layer &top_layer, matrix &dw, const int train = 1) {}
 	virtual matrix * new_connection(base_layer &top, int weight_mat_index)
@@ -406,6 +465,50 @@ public:
 };
 
 
+//----------------------------------------------------------------------------------------------------------
+// S O F T M A X
+// 
+// normalizes the previous layer into probabilities. put it last, after a fully_connected layer with identity activation
+// when training, the network sets delta of this layer wrt its input (fused softmax + cross entropy: p - onehot),
+// so distribute_delta just hands it up
+class softmax_layer : public base_layer
+{
+public:
+	softmax_layer(const char *layer_name, activation_function *p = NULL) : base_layer(layer_name, 1)
+	{
+		p_act = p; p_act = new_activation_function("identity");
+	}
+	virtual  ~softmax_layer() {}
+	virtual std::string get_config_string() { std::string str = "softmax\n"; return str; }
+
+	virtual void activate_nodes() { return; }
+	// no weights 
+	virtual void calculate_dw(const base_layer &top_layer, matrix &dw, const int train = 1) {}
+	virtual matrix * new_connection(base_layer &top, int weight_mat_index)
+	{
+		// wasteful to add weight matrix (1x1x1), but makes other parts of code more OO
+		top.forward_linked_layers.push_back(std::make_pair(weight_mat_index, this));
+		resize(top.node.cols, top.node.rows, top.node.chans);
+#ifndef NO_TRAINING_CODE
+		backward_linked_layers.push_back(std::make_pair(weight_mat_index, &top));
+#endif
+		return new matrix(1, 1, 1);
+	}
+
+	virtual void accumulate_signal(const base_layer &top, const matrix &w, const int train = 0)
+	{
+		softmax::f(top.node.x, node.x, top.node.size());
+	}
+#ifndef NO_TRAINING_CODE
+
+	virtual void distribute_delta(base_layer &top, const matrix &w, const int train = 1)
+	{
+		const int size = top.delta.size();
+		for (int k = 0; k < size; k++) top.delta.x[k] += delta.x[k];
+	}
+#endif
+};
+
 //----------------------------------------------------------------------------------------------------------
 // F R A C T I O N A L    M A X   P O O L I N G   
 //  - not working yet
@@ -667,6 +770,19 @@ public:
 		}
 	}
 
+	// activate a max pool of this layer's (not activated) sums instead of the layer itself. same result as pooling the
+	// activated nodes since all activations are non-decreasing, but runs on the smaller map (see optimize_for_inference)
+	void activate_pooled(matrix &pooled)
+	{
+		const int map_size = pooled.rows*pooled.cols;
+		for (int c=0; c<maps; c++) 
+		{
+			const float b = bias.x[c];
+			float *x= &pooled.x[c*map_size];
+			for (int i=0; i<map_size; i++) x[i]=p_act->f(x,i,map_size,b);
+		}
+	}
+
 
 	virtual void accumulate_signal( const base_layer &top, const matrix &w, const int train =0)
 	{	
@@ -937,7 +1053,7 @@ public:
 				for (int k = 0; k<top_delta_chans; k++) // input channels --- same as kernels_per_map - kern for each input
 				{
 					_w = &w.x[(k*maps + map)*kernel_size];
-					for (int ii = 0; ii < 9; ii++) filter_ptr[ii] = _w[12 - ii];
+					for (int ii = 0; ii < 9; ii++) filter_ptr[ii] = _w[8 - ii];
 
 					dot_unwrapped_3x3_sse(img_ptr, filter_ptr, imgout_ptr, outsize);
 
@@ -991,9 +1107,6 @@ public:
 		int kernel_map_step = kernel_size*kernels_per_map;
 		int map_size=delta.cols*delta.rows;
 
-		dw.resize(kernel_cols, kernel_rows,kernels_per_map*maps);
-		dw.fill(0);
-		
 		// node x already init to 0
 		output_index=0;
 		const int top_node_size= top.node.cols;
@@ -1095,6 +1208,173 @@ public:
 #endif
 };
 
+//----------------------------------------------------------------------------------------------------------
+// B I N A R Y   C O N V O L U T I O N   
+//
+// convolution of sign(input) with alpha*sign(w), alpha being the mean |w| of each map.
+// each input row is packed once per call into a bit stream, pixel major with a bit per input chan. a kernel row is
+// then a window of kernel_cols*chans bits in it, so a receptive field is gathered with shifts and dotted with every
+// map by xnor/popcount. weights are packed to match. training works like binary_fully_connected
+class binary_convolution_layer : public convolution_layer
+{
+	binary_matrix _packed; // only used when given float weights
+	const float *_packed_from; // the weights _packed holds at inference, NULL when made while training
+	std::vector<unsigned long long> _in_bits, _patch;
+	std::vector<float> _alpha; // per map weight scales of _w_signs
+#ifndef NO_TRAINING_CODE
+	matrix _w_signs; // alpha*sign(w) as floats, unpacked from the pack with id _signs_pack
+	unsigned int _signs_pack;
+	matrix _top_delta;
+	input_layer _sign_top; // sign of the input, for calculate_dw
+	matrix _dw_scratch; // this sample's gradient before the map scales
+#endif
+public:
+	binary_convolution_layer(const char *layer_name, int _w, int _h, int _c, activation_function *p ) : convolution_layer(layer_name, _w, _h, _c, p), _packed_from(NULL)
+		#ifndef NO_TRAINING_CODE
+		,_signs_pack(0), _sign_top("sign", 1)
+		#endif
+	{}
+	virtual std::string get_config_string() {std::string str="binary_convolution "+int2str(kernel_cols)+" "+int2str(kernel_rows)+" "+int2str(maps)+" "+p_act->name+"\n"; return str;}
+	virtual bool binary_weights() { return true; }
+
+	// row per map: kernel_rows groups of binary_words(kernel_cols*chans) words, bit kx*chans+chan in a group
+	virtual void pack_weights(const matrix &w, binary_matrix &packed)
+	{
+		const int kernel_size = kernel_cols*kernel_rows;
+		const int chans = w.chans / maps;
+		const int rw = binary_words(kernel_cols*chans);
+		packed.resize(kernel_rows*rw, maps, kernel_size*chans);
+		// a row is built aside and then stored word by word, packed may be in use (see binary_matrix::resize)
+		std::vector<unsigned long long> r(packed.words);
+		for (int map = 0; map < maps; map++)
+		{
+			std::fill(r.begin(), r.end(), 0ULL);
+			float a = 0;
+			for (int k = 0; k < chans; k++)
+			{
+				const float *_w = &w.x[(map + k*maps)*kernel_size];
+				for (int jj = 0; jj < kernel_rows; jj++)
+					for (int ii = 0; ii < kernel_cols; ii++)
+					{
+						const float v = _w[ii + jj*kernel_cols];
+						const int b = ii*chans + k;
+						a += std::fabs(v);
+						if (v < 0) r[jj*rw + b / 64] |= 1ULL << (b % 64);
+					}
+			}
+			std::copy(r.begin(), r.end(), packed.row(map));
+			packed.alpha[map] = a / (float)(kernel_size*chans);
+		}
+		packed.pack_id = binary_matrix::next_pack_id();
+	}
+
+	// float weights are packed once for inference, and every call while training as they move
+	virtual void accumulate_signal( const base_layer &top, const matrix &w, const int train =0)
+	{
+		if (train || _packed_from != w.x || _packed.rows != maps) { pack_weights(w, _packed); _packed_from = train ? NULL : w.x; }
+		accumulate_signal_binary(top, _packed, train);
+	}
+
+	virtual void accumulate_signal_binary(const base_layer &top, const binary_matrix &w, const int train =0)
+	{
+		const int chans = top.node.chans;
+		const int top_cols = top.node.cols;
+		const int kstep = top_cols*top.node.rows;
+		// one spare word per row (and at the end) so shifted reads can run past the last pixel
+		const int stride = binary_words(top_cols*chans) + 1;
+		_in_bits.assign(stride*top.node.rows + 1, 0);
+		for (int k = 0; k < chans; k++)
+		{
+			const float *in = &top.node.x[k*kstep];
+			for (int j = 0; j < top.node.rows; j++)
+			{
+				unsigned long long *out = &_in_bits[j*stride];
+				for (int i = 0; i < top_cols; i++)
+					if (in[i + j*top_cols] < 0) { const int b = i*chans + k; out[b / 64] |= 1ULL << (b % 64); }
+			}
+		}
+
+		const int row_bits = kernel_cols*chans;
+		const int rw = binary_words(row_bits);
+		const unsigned long long last = (row_bits % 64) ? (1ULL << (row_bits % 64)) - 1 : ~0ULL;
+		const int map_size = node.cols*node.rows;
+		_patch.resize(w.words);
+		unsigned long long *patch = _patch.data();
+		for (int j = 0; j < node.rows; j++)
+			for (int i = 0; i < node.cols; i++)
+			{
+				// gather the receptive field
+				const int o = i*chans;
+				const int sh = o % 64;
+				for (int jj = 0; jj < kernel_rows; jj++)
+				{
+					const unsigned long long *in = &_in_bits[(j + jj)*stride + o / 64];
+					unsigned long long *p = patch + jj*rw;
+					if (sh == 0) for (int q = 0; q < rw; q++) p[q] = in[q];
+					else for (int q = 0; q < rw; q++) p[q] = (in[q] >> sh) | (in[q + 1] << (64 - sh));
+					p[rw - 1] &= last;
+				}
+				float *out = &node.x[i + j*node.cols];
+				for (int map = 0; map < maps; map++)
+					out[map*map_size] += w.alpha[map] * (float)(w.bits - 2 * popcount_xor(patch, w.row(map), w.words));
+			}
+	}
+
+#ifndef NO_TRAINING_CODE
+	// float convolution with the binarized weights, then the straight through mask on the input
+	virtual void distribute_delta(base_layer &top, const matrix &w, const int train=1)
+	{
+		pack_weights(w, _packed); _packed_from = NULL;
+		distribute_delta_binary(top, w, _packed, train);
+	}
+
+	// _w_signs is unpacked from the packed weights again only when they were repacked (an update, not a sample)
+	virtual void distribute_delta_binary(base_layer &top, const matrix &w, const binary_matrix &packed, const int train=1)
+	{
+		const unsigned int pack = packed.pack_id.load();
+		if (pack != _signs_pack || _w_signs.size() != w.size())
+		{
+			const int kernel_size = kernel_cols*kernel_rows;
+			const int chans = w.chans / maps;
+			const int rw = binary_words(kernel_cols*chans);
+			_alpha.assign(packed.alpha.begin(), packed.alpha.end());
+			_w_signs.resize(w.cols, w.rows, w.chans);
+			for (int map = 0; map < maps; map++)
+			{
+				const unsigned long long *r = packed.row(map);
+				for (int k = 0; k < chans; k++)
+				{
+					float *_w = &_w_signs.x[(map + k*maps)*kernel_size];
+					for (int jj = 0; jj < kernel_rows; jj++)
+						for (int ii = 0; ii < kernel_cols; ii++)
+						{
+							const int b = ii*chans + k;
+							_w[ii + jj*kernel_cols] = ((r[jj*rw + b / 64] >> (b % 64)) & 1) ? -_alpha[map] : _alpha[map];
+						}
+				}
+			}
+			_signs_pack = pack;
+		}
+
+		_top_delta = top.delta;
+		convolution_layer::distribute_delta(top, _w_signs, train);
+		for (int i = 0; i < top.delta.size(); i++) if (std::fabs(top.node.x[i]) > 1.f) top.delta.x[i] = _top_delta.x[i];
+	}
+
+	// gradient wrt the binarized weights (so from sign(input)), passed straight through to the float ones
+	virtual void calculate_dw(const base_layer &top, matrix &dw, const int train =1)
+	{
+		if (_sign_top.node.size() != top.node.size()) _sign_top.resize(top.node.cols, top.node.rows, top.node.chans);
+		for (int i = 0; i < top.node.size(); i++) _sign_top.node.x[i] = binary_sign(top.node.x[i]);
+		_dw_scratch.resize(dw.cols, dw.rows, dw.chans);
+		_dw_scratch.fill(0);
+		convolution_layer::calculate_dw(_sign_top, _dw_scratch, train);
+		const int kernel_size = kernel_cols*kernel_rows;
+		for (int i = 0; i < dw.size(); i++) dw.x[i] += _dw_scratch.x[i] * _alpha[(i / kernel_size) % maps];
+	}
+#endif
+};
+
 
 //----------------------------------------------------------------------------------------------------------
 // C O N C A T I N A T I O N   
@@ -1115,7 +1395,8 @@ public:
 //--------------------------------------------------
 // N E W    L A Y E R 
 //
-// "input", "fully_connected","max_pool","convolution","concatination"
+// "input", "fully_connected","max_pool","convolution","dropout","softmax","concatination",
+// "binary_fully_connected","binary_convolution"
 base_layer *new_layer(const char *layer_name, const char *config)
 {
 	std::istringstream iss(config); 
@@ -1152,6 +1433,18 @@ base_layer *new_layer(const char *layer_name, const char *config)
 		iss>>w;iss>>h;iss>>c; iss>>act; 
 		return new convolution_layer(layer_name, w,h,c, new_activation_function(act));
 	}
+	else if(str.compare("binary_fully_connected")==0)
+	{
+		std::string act;
+		iss>>c; iss>>act; 
+		return new binary_fully_connected_layer(layer_name, c, new_activation_function(act));
+	}
+	else if(str.compare("binary_convolution")==0)
+	{
+		std::string act;
+		iss>>w;iss>>h;iss>>c; iss>>act; 
+		return new binary_convolution_layer(layer_name, w,h,c, new_activation_function(act));
+	}
 	else if (str.compare("dropout") == 0)
 	{
 		float fc;
@@ -1159,6 +1452,10 @@ base_layer *new_layer(const char *layer_name, const char *config)
 		iss >> fc;
 		return new dropout_layer(layer_name, fc);
 	}
+	else if (str.compare("softmax") == 0)
+	{
+		return new softmax_layer(layer_name);
+	}
 	else if(str.compare("concatination")==0)
 	{
 		iss>>w;iss>>h;iss>>c;  
@@ -31,8 +31,11 @@
 #include <sstream>
 #include <map>
 #include <vector>
+#include <atomic>
+#include <thread>
 
 #include "layer.h"
+#include "plan.h"
 #include "optimizer.h"
 #include "activation.h"
 #include "cost.h"
@@ -109,26 +112,84 @@ class network
 
 	// training related stuff
 	int _batch_size;   // determines number of dW sets 
-	float _skip_energy_level;
+	std::atomic<float> _skip_energy_level;
 	bool _smart_train;
-	std::vector <float> _running_E;
-	double _running_sum_E;
+	// smart training statistics, one per layer set and written by its thread only: the epoch's counts and a
+	// histogram of sample energies. a thread that has seen its share of SMART_TRAIN_SAMPLE_SIZE merges all the
+	// histograms and sets the skip level from the energies since the last merge (see update_smart_train).
+	// nothing waits, a merge reads counts still moving and is a sample or two off at worst
+	static const int SMART_TRAIN_SAMPLE_SIZE = 1000;
+	static const int SMART_BINS = 256; // 8 per octave of E from 2^-30 (see smart_bin)
+	struct smart_stats
+	{
+		int samples, correct, skipped; // this epoch, added up into train_* by end_epoch
+		int due;                        // samples until this thread merges
+		std::atomic<unsigned int> bins[SMART_BINS]; // energies ever seen
+		std::atomic<double> sum_E;
+		char pad[64];                   // keeps the next thread's counts off this one's cache lines
+	};
+	std::vector<smart_stats> _smart_stats;
+	std::vector<unsigned int> _smart_merged, _smart_totals; // all threads' bins at the last merge, scratch
+	double _smart_merged_E;
+	std::atomic<bool> _smart_merging;
+	// what each training sample did the last time it ran, by sample index (see set_sample_cache)
+	struct sample_record
+	{
+		float E;
+		unsigned short epoch;  // epoch_count, mod 2^16
+		unsigned char correct;
+		unsigned char skips;   // times in a row smart training skipped it, 0 runs it next time
+	};
+	std::vector<sample_record> _sample_cache;
+	int _sample_cache_max_skip;
 	cost_function *_cost_function;
+	// because of numerator/demoninator cancellations which prevent a divide by zero issue, 
+	// some output activation + cost pairs are handled special. set in start_epoch()
+	float _cost_activation_type;
+	// softmax output layer: 0 none, 1 generic cost through softmax::df, 2 fused cross entropy. set in start_epoch()
+	int _softmax_cost;
 	optimizer *_optimizer;
-	const unsigned char BATCH_RESERVED = 1, BATCH_FREE = 0, BATCH_COMPLETE = 2;
+	// worker threads for train_epoch, predict_many and intra-op splitting (see set_threads). NULL for none
+	thread_pool *_pool;
+	bool _intra_op; // compiled passes split their layers over _pool
+	// a slot is FREE until its ticket is taken, SKIPPED when given back by a sample smart training skipped
+	const unsigned char BATCH_RESERVED = 1, BATCH_FREE = 0, BATCH_COMPLETE = 2, BATCH_SKIPPED = 3;
 	const int BATCH_FILLED_COMPLETE = -2, BATCH_FILLED_IN_PROCESS = -1;
+	// lock free mini batch slots: tickets hand out fresh slots of the open batch, the sample that completes the
+	// last slot closes the batch. _batch_ticket is (open batch, next ticket), so a ticket knows its batch and
+	// samples waiting for a slot watch the batch number
+	std::atomic<int> _batch_done, _batch_skipped;
+	std::atomic<unsigned long long> _batch_ticket;
+	// bounded staleness (see set_staleness): up to _staleness closed batches wait to be applied while the next
+	// ones fill. each batch in flight has its own bank of gradient sets and update state, bank = batch % banks
+	int _staleness;
+	std::atomic<unsigned int> _batches_applied; // batches before this one are in the weights
+	// the batch update is split into chunks (one range of one weight matrix, or one layer's bias, summed over
+	// the threads and stepped by the optimizer), last layer's first. a layer's chunks go out as soon as every
+	// sample of the batch is past it in backward, so they run while backward goes on into the layers before.
+	// the samples waiting for a slot work on them, for the oldest batch not applied only.
+	// per bank, _sync_job is (batch, chunks out) and _sync_claim (batch, next chunk), so a late claim never
+	// runs a newer batch's chunk
+	struct sync_chunk { int layer, w_index, begin, end; }; // w_index < 0 for the layer's bias
+	const int SYNC_CHUNK_SIZE = 16384;
+	std::vector<sync_chunk> _sync_chunks;
+	std::vector<int> _layer_chunks_end; // a layer's chunks end here, per layer
+	std::vector< std::atomic<int> > _layer_done; // per bank and layer, samples of the batch past the layer in backward
+	std::vector< std::atomic<unsigned long long> > _sync_job, _sync_claim; // per bank
+	std::vector< std::atomic<int> > _sync_done; // per bank
+	// hogwild training (see set_hogwild): each thread steps the shared weights with its own optimizer
+	// (its own adaptive state) and its gradient set as scratch, no mini batch
+	bool _hogwild;
+	std::string _optimizer_name;
+	std::vector<optimizer *> _hogwild_optimizers;
+	int _hogwild_connections; // W.size() the optimizers were made for
+	std::atomic<int> _hogwild_updates;
+	std::vector<int> _hogwild_steps; // per thread samples since it last repacked the binary layers
+	// weight storage tag in binary model files, after the PRECISION_ ones
+	const int STORAGE_BLOCK_SPARSE = 3;
 #ifdef UCNN_OMP
-	omp_lock_t _lock_batch;
-	void lock_batch() {omp_set_lock(&_lock_batch);}
-	void unlock_batch() {omp_unset_lock(&_lock_batch);}
-	void init_lock() {omp_init_lock(&_lock_batch);}
-	void destroy_lock() {omp_destroy_lock(&_lock_batch);}
 	int get_thread_num() {return omp_get_thread_num();}
 #else
-	void lock_batch() {}
-	void unlock_batch() {}
-	void init_lock(){}
-	void destroy_lock() {}
 	int get_thread_num() {return 0;}
 #endif
 
@@ -153,25 +214,64 @@ public:
 	std::map<std::string, int> layer_map;  // name-to-index of layer for layer management
 	std::vector<std::pair<std::string, std::string>> layer_graph; // pairs of names of layers that are connected
 	std::vector<matrix *> W; // these are the weights between/connecting layers 
-
-	// these sets are needed because we need copies for each item in mini-batch
-	std::vector< std::vector<matrix>> dW_sets; // only for training, will have _batch_size of these
-	std::vector< std::vector<matrix>> dbias_sets; // only for training, will have _batch_size of these
-	std::vector< unsigned char > batch_open; // only for training, will have _batch_size of these	
+	// the float weights then the main set's biases, in one block (see pack_parameters)
+	float_arena param_arena;
+	// optional 16 bit weights (see set_weight_precision). NULL when W is used as is
+	std::vector<half_matrix *> W16;
+	std::vector<int> W_precision;
+	// optional block sparse fully connected weights (see update_sparse_weights). NULL when not sparse
+	std::vector<block_sparse_matrix *> Wsparse;
+	// sparse kernel is used when at most this fraction of 4x4 blocks are non zero
+	float sparse_max_density;
+	// sign packed weights of binary_* layers (see update_binary_weights). NULL for other layers
+	std::vector<binary_matrix *> Wbin;
+	// set by optimize_for_inference, one per layer: the layer whose activation (and bias) forward() applies to
+	// this layer's nodes. normally itself, -1 for none, or the convolution feeding a fused max pool
+	std::vector<int> activation_source;
+	// flat forward passes made by compile(), one per layer set. empty when not compiled
+	std::vector<forward_plan> plans;
+	// the convolution filters padded for the plans, made once by compile() and read by the plans of every
+	// layer set and context. plan_filter_bank[j] is connection j's bank, NULL for other connections
+	float_arena plan_filters;
+	std::vector<float *> plan_filter_bank;
+	bool share_plan_activations; // compile() argument, for plans made later (context_pool)
+
+	// gradient accumulators, one per layer set (thread) and bank. samples add into their thread's set in place,
+	// the batch update sums a bank's sets into its first, steps the weights and zeroes them all
+	// (see resize_gradient_sets)
+	std::vector< std::vector<matrix>> dW_sets; // only for training, set bank*threads + thread
+	std::vector< std::vector<matrix>> dbias_sets; // only for training, set bank*threads + thread
+	// all of dW_sets and dbias_sets, set after set and each set laid out alike, so set s is the floats
+	// [s*n, (s+1)*n) with n = size()/dW_sets.size()
+	float_arena gradient_arena;
+	std::vector< std::atomic<unsigned char> > batch_open; // only for training, will have _batch_size of these	
 	
 
 	network(const char* opt_name=NULL): _thread_count(1), _skip_energy_level(0.f), _batch_size(1) 
 	{ 
 		_size=0;  
 		_optimizer = new_optimizer(opt_name);
+		_optimizer_name = opt_name ? opt_name : "";
+		_hogwild = false;
+		_hogwild_connections = 0;
+		_hogwild_updates = 0;
 		_cost_function = NULL;
+		_cost_activation_type = 0;
+		_softmax_cost = 0;
+		sparse_max_density = 0.9f;
+		share_plan_activations = false;
+		_pool = NULL;
+		_intra_op = false;
 		//std::vector<base_layer *> layer_set;
 		//layer_sets.push_back(layer_set);
 		layer_sets.resize(1);
-		dW_sets.resize(_batch_size);
-		dbias_sets.resize(_batch_size);
-		batch_open.resize(_batch_size);
-		_running_sum_E = 0.;
+		_batch_ticket = 0;
+		_staleness = 0;
+		_batches_applied = 0;
+		resize_batch_slots();
+		_smart_merged_E = 0;
+		_smart_merging = false;
+		_sample_cache_max_skip = 8;
 		train_correct = 0;
 		train_samples = 0;
 		train_skipped = 0;
@@ -183,7 +283,6 @@ public:
 		stuck_counter = 0;
 		best_estimated_accuracy=0;
 		best_accuracy_count=0;
-		init_lock();
 #ifdef USE_AF
 		af::setDevice(0);
         af::info();
@@ -195,7 +294,18 @@ public:
 		clear();
 		if (_cost_function) delete _cost_function;
 		if(_optimizer) delete _optimizer; 
-		destroy_lock();	
+		if (_pool) delete _pool;
+	}
+
+	// atomics can't be copied, so the slots are swapped in rather than resized
+	void resize_batch_slots()
+	{
+		std::vector< std::atomic<unsigned char> > slots(_batch_size);
+		batch_open.swap(slots);
+		for (int i = 0; i < _batch_size; i++) batch_open[i].store(BATCH_FREE);
+		_batch_done = 0;
+		_batch_skipped = 0;
+		_batch_ticket = _batch_ticket.load() & 0xffffffff00000000ull;
 	}
 
 	// call clear if you want to load a different configuration/model
@@ -204,13 +314,30 @@ public:
 		for(int i=0; i<(int)layer_sets.size(); i++)
 		{
 			__for__(auto l __in__ layer_sets[i]) delete l;
-			layer_sets.clear();
 		}
 		layer_sets.clear();
 		__for__(auto w __in__ W) delete w;  
 		W.clear();
+		__for__(auto w __in__ W16) if (w) delete w;
+		W16.clear();
+		W_precision.clear();
+		__for__(auto w __in__ Wsparse) if (w) delete w;
+		Wsparse.clear();
+		__for__(auto w __in__ Wbin) if (w) delete w;
+		Wbin.clear();
 		layer_map.clear();
 		layer_graph.clear();
+		activation_source.clear();
+		drop_plans();
+		// optimizer state mirrors W
+		if (_optimizer) _optimizer->clear();
+		__for__(auto o __in__ _hogwild_optimizers) delete o;
+		_hogwild_optimizers.clear();
+		dW_sets.clear();
+		dbias_sets.clear();
+		// after everything viewing them
+		param_arena.clear();
+		gradient_arena.clear();
 	}
 
 	// output size of final layer;
@@ -225,25 +352,53 @@ public:
 	}
 
 	// sets up number of layer copies to run over multiple threads
-	// must call this with max thread count before constructing layers
+	// sets added once the model is built are copies of the main set (see clone_layer_set). extra sets are deleted
 	void allow_threads(int threads=1)
 	{
 		if(threads<1) _thread_count=1; else _thread_count=threads;
-		int layer_cnt = (int)layer_sets.size();
 
-		if (layer_cnt<_thread_count) layer_sets.resize(_thread_count);
-		// ToDo: add shrink back /  else if(layer_cnt>_thread_count)
+		while ((int)layer_sets.size() < _thread_count) layer_sets.push_back(clone_layer_set());
+		while ((int)layer_sets.size() > _thread_count)
+		{
+			__for__(auto l __in__ layer_sets.back()) delete l;
+			layer_sets.pop_back();
+		}
+		if ((int)plans.size() > _thread_count) plans.resize(_thread_count);
+		// a compiled network stays compiled
+		if (!plans.empty())
+			for (int t = (int)plans.size(); t < _thread_count; t++)
+			{
+				plans.resize(t + 1);
+				compile_layer_set(layer_sets[t], plans[t], share_plan_activations);
+			}
 		sync_layer_sets();
 	}
 
-	// when using threads, need to get bias data synched between all layer sets, 
-	// call this after bias update in main layer set to copy the bias to the other sets
+	// a new copy of the main layer set: same layers and connections, sharing the weights and the biases.
+	// the layers only hold per pass data (nodes, scratch), so a copy can run forward passes next to the others
+	std::vector<base_layer *> clone_layer_set()
+	{
+		std::vector<base_layer *> layers;
+		if (layer_sets.empty()) return layers;
+		__for__(auto l __in__ layer_sets[MAIN_LAYER_SET]) layers.push_back(new_layer(l->name.c_str(), l->get_config_string().c_str()));
+		for (int j = 0; j < (int)layer_graph.size(); j++)
+		{
+			base_layer *top = layers[layer_map.find(layer_graph[j].first)->second];
+			base_layer *bottom = layers[layer_map.find(layer_graph[j].second)->second];
+			delete bottom->new_connection(*top, j);
+		}
+		for (int k = 0; k < (int)layers.size(); k++) layers[k]->bias.share(layer_sets[MAIN_LAYER_SET][k]->bias);
+		return layers;
+	}
+
+	// when using threads, the other layer sets read the biases of the main set: their bias matrices are views
+	// of the main set's. call this after the main set's biases are reallocated (or new sets are made) to point
+	// the other sets at them again
 	void sync_layer_sets()
 	{
 		for(int i=1; i<(int)layer_sets.size();i++)
 			for(int j=0; j<(int)layer_sets[MAIN_LAYER_SET].size(); j++)
-				for(int k=0; k<layer_sets[MAIN_LAYER_SET][j]->bias.size(); k++) 
-					(layer_sets[i])[j]->bias.x[k]=(layer_sets[MAIN_LAYER_SET])[j]->bias.x[k];
+				(layer_sets[i])[j]->bias.share((layer_sets[MAIN_LAYER_SET])[j]->bias);
 	}
 
 	// used to add some noise to weights
@@ -254,6 +409,7 @@ public:
 		__for__(auto w __in__ W) 
 			for(int c=0; c<w->size(); c++) 
 				w->x[c]*=(1.f+dst(gen)); 
+		update_binary_weights();
 	}
 
 	// used to push a layer back in the ORDERED list of layers
@@ -296,10 +452,19 @@ public:
 
 		base_layer *l_top= layer_sets[MAIN_LAYER_SET][i_top];
 		base_layer *l_bottom= layer_sets[MAIN_LAYER_SET][i_bottom];
+		// max pool maps hold the row and column inside the window in 4 bits each (see pool_map_offset)
+		max_pooling_layer *pool = dynamic_cast<max_pooling_layer*>(l_bottom);
+		if (pool && (pool->pool_rows(*l_top) > 16 || pool->pool_cols(*l_top) > 16)) bail("max_pool window over 16x16");
 		
 		int w_i=(int)W.size();
 		matrix *w = l_bottom->new_connection(*l_top, w_i);
 		W.push_back(w);
+		W16.push_back(NULL);
+		W_precision.push_back(PRECISION_FP32);
+		Wsparse.push_back(NULL);
+		Wbin.push_back(NULL);
+		activation_source.clear();
+		drop_plans();
 		layer_graph.push_back(std::make_pair(layer_name_top,layer_name_bottom));
 		// need to build connections for other batches/threads
 		for(int i=1; i<(int)layer_sets.size(); i++)
@@ -309,6 +474,9 @@ public:
 			delete l_bottom->new_connection(*l_top, w_i);
 		}
 
+		// layers without their own size (softmax, pool, ..) only know it once connected
+		_size = layer_sets[MAIN_LAYER_SET][layer_sets[MAIN_LAYER_SET].size() - 1]->fan_size();
+
 		// we need to let optimizer prepare space for stateful information 
 		if (_optimizer)	_optimizer->push_back(w->cols, w->rows, w->chans);
 
@@ -345,6 +513,20 @@ public:
 			float weight_base = (float)(std::sqrt(1./(double)fan_in));
 			w->fill_random_uniform(weight_base);
 		}
+		pack_parameters();
+		if (l_bottom->binary_weights()) update_binary_weights();
+	}
+
+	// lays the float weights and the main set's biases out in param_arena. called as connections are made, so
+	// the layout is fixed before any plan takes pointers into it. weights swapped for 16 bit or sparse copies
+	// later leave a hole, ones widened again get their own memory
+	void pack_parameters()
+	{
+		std::vector<matrix *> m;
+		__for__(auto w __in__ W) m.push_back(w);
+		__for__(auto l __in__ layer_sets[MAIN_LAYER_SET]) m.push_back(&l->bias);
+		param_arena.pack(m);
+		sync_layer_sets();
 	}
 
 	// automatically connect all layers in the order they were provided 
@@ -369,6 +551,423 @@ public:
 		return str;
 	}
 
+	// store weights as "fp16", "bf16" or "fp32" - for all layers, or just the weights feeding layer_name
+	// a network without an optimizer (inference only) drops its float weights and runs from the 16 bit copy.
+	// when training, W stays the float master copy and the precision only applies to write()
+	bool set_weight_precision(const char *precision, const char *layer_name = NULL)
+	{
+		const int p = precision_from_name(precision);
+		if (p < 0) return false;
+		drop_plans();
+		for (int j = 0; j < (int)W.size(); j++)
+		{
+			if (layer_name && layer_graph[j].second.compare(layer_name) != 0) continue;
+			// no point for the 1x1 placeholders of pool/dropout/softmax, binary layers are already 1 bit
+			if (W[j]->size() <= 1 && W16[j] == NULL) continue;
+			if (Wbin[j]) continue;
+			W_precision[j] = p;
+			if (_optimizer) continue;
+			if (W16[j]) { W16[j]->widen(*W[j]); delete W16[j]; W16[j] = NULL; }
+			if (p == PRECISION_FP32) continue;
+			W16[j] = new half_matrix(*W[j], p);
+			delete W[j]; W[j] = new matrix();
+		}
+		return true;
+	}
+
+	// float weights of connection j. 16 bit or sparse weights are expanded into tmp
+	const matrix &float_weights(int j, matrix &tmp)
+	{
+		if (Wsparse[j]) { Wsparse[j]->to_dense(tmp); return tmp; }
+		if (W16[j] == NULL) return *W[j];
+		W16[j]->widen(tmp);
+		return tmp;
+	}
+
+	// makes W[j] the live float copy again, dropping 16 bit / sparse copies. for tools that edit weights
+	matrix *unpack_weights(int j)
+	{
+		drop_plans();
+		if (W16[j]) { W16[j]->widen(*W[j]); delete W16[j]; W16[j] = NULL; }
+		if (Wsparse[j]) { Wsparse[j]->to_dense(*W[j]); delete Wsparse[j]; Wsparse[j] = NULL; }
+		return W[j];
+	}
+
+	// the layer connection j feeds into
+	base_layer *bottom_layer(int j) { return layer_sets[MAIN_LAYER_SET][layer_map[layer_graph[j].second]]; }
+
+	// inference only (no optimizer): fully connected weights with a 4x4 block density at or under sparse_max_density
+	// are moved to the block sparse kernel. called by read(), call again after pruning. returns the number of sparse connections
+	int update_sparse_weights()
+	{
+		int cnt = 0;
+		for (int j = 0; j < (int)W.size(); j++)
+		{
+			if (Wsparse[j]) { cnt++; continue; }
+			if (_optimizer || W16[j] || W[j]->size() == 0) continue;
+			if (dynamic_cast<fully_connected_layer*>(bottom_layer(j)) == NULL) continue;
+			if (block_sparse_matrix::block_density(*W[j]) > sparse_max_density) continue;
+			drop_plans();
+			Wsparse[j] = new block_sparse_matrix(*W[j]);
+			delete W[j]; W[j] = new matrix();
+			cnt++;
+		}
+		return cnt;
+	}
+
+	// (re)packs the weights of binary layers from W. when training the float weights are first clipped to [-1,1]
+	// so they stay where the sign can still flip. called by connect(), read() and after each weight update
+	int update_binary_weights()
+	{
+		int cnt = 0;
+		for (int j = 0; j < (int)W.size(); j++)
+		{
+			base_layer *l = bottom_layer(j);
+			if (!l->binary_weights()) continue;
+			if (_optimizer) W[j]->clip(-1.f, 1.f);
+			if (Wbin[j] == NULL) Wbin[j] = new binary_matrix();
+			l->pack_weights(*W[j], *Wbin[j]);
+			cnt++;
+		}
+		return cnt;
+	}
+
+	// rebuilds the forward/backward links of every layer set from layer_graph. for graph edits after connect()
+	void relink()
+	{
+		for (int i = 0; i < (int)layer_sets.size(); i++)
+		{
+			__for__(auto l __in__ layer_sets[i])
+			{
+				l->forward_linked_layers.clear();
+				#ifndef NO_TRAINING_CODE
+				l->backward_linked_layers.clear();
+				#endif
+			}
+			for (int j = 0; j < (int)layer_graph.size(); j++)
+			{
+				base_layer *top = layer_sets[i][layer_map[layer_graph[j].first]];
+				base_layer *bottom = layer_sets[i][layer_map[layer_graph[j].second]];
+				top->forward_linked_layers.push_back(std::make_pair(j, bottom));
+				#ifndef NO_TRAINING_CODE
+				bottom->backward_linked_layers.push_back(std::make_pair(j, top));
+				#endif
+			}
+		}
+	}
+
+	// folds a layer that multiplies its input by s into the weights and bias of the layer feeding it (name).
+	// only for positively homogeneous activations where f(s*x)=s*f(x)
+	bool fold_scale(const std::string &name, const float s)
+	{
+		base_layer *l = layer_sets[MAIN_LAYER_SET][layer_map[name]];
+		const std::string act = l->p_act->name;
+		if (s <= 0 || (act != identity::name && act != relu::name && act != lrelu::name && act != vlrelu::name)) return false;
+		std::vector<int> in;
+		for (int j = 0; j < (int)layer_graph.size(); j++)
+		{
+			if (layer_graph[j].second != name) continue;
+			// pool, dropout, .. have nothing to fold into
+			if (W[j]->size() <= 1 && W16[j] == NULL && Wsparse[j] == NULL) return false;
+			in.push_back(j);
+		}
+		if (in.empty()) return false;
+		__for__(auto j __in__ in)
+		{
+			matrix *w = unpack_weights(j);
+			for (int i = 0; i < w->size(); i++) w->x[i] *= s;
+			if (W_precision[j] != PRECISION_FP32) { W16[j] = new half_matrix(*w, W_precision[j]); delete W[j]; W[j] = new matrix(); }
+		}
+		for (int i = 0; i < l->bias.size(); i++) l->bias.x[i] *= s;
+		sync_layer_sets();
+		return true;
+	}
+
+	// rewrites the graph of a trained network for inference (no optimizer, otherwise does nothing and returns -1):
+	// - removes layers that only pass (scale) their input, dropout. a scale other than 1 is folded into the weights before
+	// - a max pool that is the only output of a convolution gets the activation of the convolution, so that
+	//   runs on the pooled map, and layers with an identity activation and zero bias are not activated at all
+	// returns the number of layers removed or fused. call again after changing the network
+	int optimize_for_inference()
+	{
+		if (_optimizer) return -1;
+		drop_plans();
+		int cnt = 0;
+		for (int k = 1; k < (int)layer_sets[MAIN_LAYER_SET].size(); k++)
+		{
+			base_layer *l = layer_sets[MAIN_LAYER_SET][k];
+			const float s = l->inference_scale();
+			if (s <= 0) continue;
+			int in = -1, in_cnt = 0;
+			for (int j = 0; j < (int)layer_graph.size(); j++) if (layer_graph[j].second == l->name) { in = j; in_cnt++; }
+			if (in_cnt != 1) continue;
+			const std::string top = layer_graph[in].first;
+			if (s != 1.f && !fold_scale(top, s)) continue;
+
+			// outputs now come straight from the top layer. the weights already have the right shape
+			for (int j = 0; j < (int)layer_graph.size(); j++) if (layer_graph[j].first == l->name) layer_graph[j].first = top;
+			delete W[in];
+			if (W16[in]) delete W16[in];
+			if (Wsparse[in]) delete Wsparse[in];
+			if (Wbin[in]) delete Wbin[in];
+			W.erase(W.begin() + in); W16.erase(W16.begin() + in); W_precision.erase(W_precision.begin() + in);
+			Wsparse.erase(Wsparse.begin() + in); Wbin.erase(Wbin.begin() + in);
+			layer_graph.erase(layer_graph.begin() + in);
+
+			layer_map.erase(l->name);
+			for (int i = 0; i < (int)layer_sets.size(); i++)
+			{
+				delete layer_sets[i][k];
+				layer_sets[i].erase(layer_sets[i].begin() + k);
+			}
+			for (int i = k; i < (int)layer_sets[MAIN_LAYER_SET].size(); i++) layer_map[layer_sets[MAIN_LAYER_SET][i]->name] = i;
+			k--;
+			cnt++;
+		}
+		relink();
+		std::vector<base_layer *> &layers = layer_sets[MAIN_LAYER_SET];
+		_size = layers[layers.size() - 1]->fan_size();
+		update_binary_weights();
+		update_sparse_weights();
+
+		activation_source.resize(layers.size());
+		for (int k = 0; k < (int)layers.size(); k++)
+		{
+			activation_source[k] = k;
+			if (std::string(identity::name) != layers[k]->p_act->name) continue;
+			bool zero = true;
+			for (int i = 0; i < layers[k]->bias.size() && zero; i++) zero = layers[k]->bias.x[i] == 0;
+			if (zero) activation_source[k] = -1;
+		}
+		for (int k = 0; k < (int)layers.size(); k++)
+		{
+			if (activation_source[k] != k || layers[k]->forward_linked_layers.size() != 1) continue;
+			if (dynamic_cast<convolution_layer*>(layers[k]) == NULL) continue;
+			base_layer *pool = layers[k]->forward_linked_layers[0].second;
+			if (dynamic_cast<max_pooling_layer*>(pool) == NULL) continue;
+			int in_cnt = 0;
+			for (int j = 0; j < (int)layer_graph.size(); j++) if (layer_graph[j].second == pool->name) in_cnt++;
+			if (in_cnt != 1) continue;
+			activation_source[layer_map[pool->name]] = k;
+			activation_source[k] = -1;
+			cnt++;
+		}
+		return cnt;
+	}
+
+	// freezes the network into a flat list of kernel calls per layer set (see plan.h) that forward() then runs:
+	// buffers, weights and shapes are resolved and kernels picked once, so a pass has no virtual calls or lookups.
+	// convolution filters are copied (see plan_filters), so call again after the weights change. graph or storage changes
+	// (connect, read, set_weight_precision, optimize_for_inference, ..) drop the plans. inference only, returns false
+	// for a network with an optimizer.
+	// share_activations puts the activations in one arena per layer set, reusing memory once a node is no longer
+	// read (see forward_plan::share_activations). the moved layer nodes then view the arena and no longer hold
+	// the activations after a pass. they get memory of their own again when the plans are dropped
+	bool compile(const bool share_activations = false)
+	{
+		drop_plans();
+		if (_optimizer) return false;
+		pack_plan_filters();
+		plans.resize(layer_sets.size());
+		for (int t = 0; t < (int)layer_sets.size(); t++) compile_layer_set(layer_sets[t], plans[t], share_activations);
+		share_plan_activations = share_activations;
+		return true;
+	}
+
+	// number of threads (the calling one included) train_epoch and predict_many run on, without OpenMP.
+	// the same pool does intra-op splitting (set_intra_op_threads), so the two do not compete for cores
+	void set_threads(int threads)
+	{
+		drop_plans();
+		if (_pool) delete _pool;
+		_pool = threads > 1 ? new thread_pool(threads) : NULL;
+		_intra_op = false;
+	}
+	int get_threads() { return _pool ? _pool->size() : 1; }
+
+	// low latency single sample inference: a compiled forward pass splits each layer's work (conv output maps,
+	// fully connected rows, pool channels) over this many threads, the calling one included. a layer is only
+	// split as far as its cost pays for the hand off. call before compile(). 1 turns it off.
+	// inside predict_many the pool is already busy, so those passes run each layer whole
+	void set_intra_op_threads(int threads)
+	{
+		set_threads(threads);
+		_intra_op = _pool != NULL;
+	}
+
+	// drops the compiled plans, after giving the layer nodes moved into their arenas memory of their own again
+	void drop_plans()
+	{
+		__for__(auto &layers __in__ layer_sets)
+			__for__(auto layer __in__ layers) layer->node.own();
+		plans.clear();
+		plan_filters.clear();
+		plan_filter_bank.clear();
+	}
+
+	// copies the float convolution filters into plan_filters, each filter padded to the plans' filter_step
+	void pack_plan_filters()
+	{
+		plan_filter_bank.assign(W.size(), NULL);
+		std::vector<size_t> at(W.size(), 0);
+		size_t n = 0;
+		for (int j = 0; j < (int)W.size(); j++)
+		{
+			convolution_layer *conv = dynamic_cast<convolution_layer*>(bottom_layer(j));
+			if (conv == NULL || Wbin[j]) continue;
+			const int kernel_size = conv->kernel_cols*conv->kernel_rows;
+			const int filters = (W16[j] ? W16[j]->size() : W[j]->size()) / kernel_size;
+			at[j] = n;
+			n += float_arena::padded((size_t)filters*plan_filter_step(conv->kernel_cols, conv->kernel_rows));
+		}
+		plan_filters.allocate(n);
+		for (int j = 0; j < (int)W.size(); j++)
+		{
+			convolution_layer *conv = dynamic_cast<convolution_layer*>(bottom_layer(j));
+			if (conv == NULL || Wbin[j]) continue;
+			matrix tmp;
+			const matrix &w = float_weights(j, tmp);
+			const int kernel_size = conv->kernel_cols*conv->kernel_rows;
+			const int step = plan_filter_step(conv->kernel_cols, conv->kernel_rows);
+			float *bank = plan_filters.data() + at[j];
+			for (int f = 0; f < w.size() / kernel_size; f++) memcpy(bank + f*step, w.x + f*kernel_size, kernel_size*sizeof(float));
+			plan_filter_bank[j] = bank;
+		}
+	}
+
+	// bytes allocated for the activations of a layer set (context): the compiled plan when there is one
+	size_t activation_bytes(const int t = 0)
+	{
+		if (t < (int)plans.size()) return plans[t].activation_bytes();
+		size_t bytes = 0;
+		__for__(auto layer __in__ layer_sets[t]) bytes += sizeof(float)*layer->node.size();
+		return bytes;
+	}
+
+	// only reads the model, so it can build plans for other layer sets (contexts) while those run
+	void compile_layer_set(std::vector<base_layer *> &layers, forward_plan &p, const bool share_activations = false)
+	{
+		const bool planned = activation_source.size() == layers.size();
+		p.pool = _intra_op ? _pool : NULL;
+		p.input = layers[0]->node.x;
+		p.input_size = layers[0]->node.size();
+		p.output = layers[layers.size() - 1]->node.x;
+		std::vector<matrix *> nodes;
+		std::vector<float *> pinned; // nodes the steps reach through their layers
+		std::vector<float *> zeroed;
+		__for__(auto layer __in__ layers)
+		{
+			nodes.push_back(&layer->node);
+			p.node_bytes += sizeof(float)*layer->node.size();
+		}
+
+		for (int k = 0; k < (int)layers.size(); k++)
+		{
+			base_layer *l = layers[k];
+			// activation of layer a (itself, or the convolution before a fused pool) on the nodes of this one
+			const int a = planned ? activation_source[k] : k;
+			const bool no_activation = dynamic_cast<input_layer*>(l) || dynamic_cast<max_pooling_layer*>(l)
+				|| dynamic_cast<fractional_max_pooling_layer*>(l) || dynamic_cast<dropout_layer*>(l)
+				|| dynamic_cast<softmax_layer*>(l);
+			if (a >= 0 && !(a == k && no_activation))
+			{
+				const bool per_map = dynamic_cast<convolution_layer*>(layers[a]) != NULL;
+				plan_function f = activation_step(layers[a]->p_act->name, per_map);
+				if (a != k && !per_map) bail("bad activation plan");
+				plan_step &s = p.add(f ? f : &step_layer_activate);
+				if (!f) pinned.push_back(l->node.x);
+				s.layer = l;
+				s.out = l->node.x;
+				s.bias = layers[a]->bias.x; // the main set's (see sync_layer_sets)
+				s.out_cols = l->node.cols; s.out_rows = l->node.rows; s.out_chans = l->node.chans;
+				s.units = per_map ? l->node.chans : l->node.size();
+				s.work = 4.f*l->node.size();
+			}
+
+			__for__(auto &link __in__ l->forward_linked_layers)
+			{
+				const int j = link.first;
+				base_layer *b = link.second;
+				// bottom nodes are accumulated into, zero them before the first write
+				if (std::find(zeroed.begin(), zeroed.end(), b->node.x) == zeroed.end())
+				{
+					plan_step &z = p.add(&step_zero);
+					z.out = b->node.x;
+					z.out_cols = b->node.cols; z.out_rows = b->node.rows; z.out_chans = b->node.chans;
+					zeroed.push_back(b->node.x);
+				}
+				plan_step &s = p.add(&step_layer);
+				s.top = l; s.layer = b;
+				s.in = l->node.x; s.out = b->node.x;
+				s.in_cols = l->node.cols; s.in_rows = l->node.rows; s.in_chans = l->node.chans;
+				s.out_cols = b->node.cols; s.out_rows = b->node.rows; s.out_chans = b->node.chans;
+				s.packed = W[j];
+				convolution_layer *conv = dynamic_cast<convolution_layer*>(b);
+				max_pooling_layer *pool = dynamic_cast<max_pooling_layer*>(b);
+				if (Wbin[j])
+				{
+					s.packed = Wbin[j];
+					if (dynamic_cast<binary_convolution_layer*>(b)) s.run = &step_binary_convolution;
+					else if (dynamic_cast<binary_fully_connected_layer*>(b)) s.run = &step_binary_fully_connected;
+					else bail("unknown binary layer");
+				}
+				else if (conv)
+				{
+					const int kernel_size = conv->kernel_cols*conv->kernel_rows;
+					s.kernel_cols = conv->kernel_cols; s.kernel_rows = conv->kernel_rows;
+					s.filter_step = plan_filter_step(conv->kernel_cols, conv->kernel_rows);
+					s.run = &step_convolution;
+					if (conv->kernel_cols == 3 && conv->kernel_rows == 3) s.run = &step_convolution_k<3>;
+					if (conv->kernel_cols == 5 && conv->kernel_rows == 5) s.run = &step_convolution_k<5>;
+#ifdef UCNN_SSE3
+					// filters padded to the unwrapped window size (see unwrap_aligned)
+					if (conv->kernel_cols == 3 && conv->kernel_rows == 3) s.run = &step_convolution_unwrapped<3>;
+					if (conv->kernel_cols == 5 && conv->kernel_rows == 5) s.run = &step_convolution_unwrapped<5>;
+#endif
+					const int outsize = s.out_cols*s.out_rows;
+					s.units = conv->maps;
+					s.work = (float)outsize*kernel_size*s.in_chans*conv->maps;
+					p.split(s);
+					// unwrapped window and dot results, per part
+					if (s.filter_step != kernel_size)
+					{
+						s.scratch_step = (outsize*s.filter_step + outsize + 3) & ~3;
+						s.scratch = p.alloc(s.scratch_step*s.parts);
+					}
+					s.w = plan_filter_bank[j];
+				}
+				else if (dynamic_cast<fully_connected_layer*>(b))
+				{
+					s.in_cols = l->node.size(); s.in_rows = 1; s.in_chans = 1;
+					s.units = b->node.size();
+					s.work = (float)s.in_cols*b->node.size();
+					if (Wsparse[j]) s.units = Wsparse[j]->block_rows();
+					if (Wsparse[j]) { s.run = &step_fully_connected_sparse; s.packed = Wsparse[j]; }
+					else if (W16[j]) { s.run = &step_fully_connected_half; s.packed = W16[j]; }
+					else { s.run = &step_fully_connected; s.w = W[j]->x; }
+				}
+				else if (pool)
+				{
+					const int px = pool->pool_cols(*l), py = pool->pool_rows(*l), st = pool->stride();
+					s.kernel_cols = px; s.kernel_rows = py; s.stride = st;
+					s.map = p.alloc_bytes(b->node.size());
+					s.units = b->node.chans;
+					s.work = (float)b->node.size()*px*py;
+					s.run = &step_max_pool_any;
+					if (px == 2 && py == 2 && st == 2) s.run = &step_max_pool<2, 2, 2>;
+					else if (px == 3 && py == 3 && st == 2) s.run = &step_max_pool<3, 3, 2>;
+					else if (px == 3 && py == 3 && st == 3) s.run = &step_max_pool<3, 3, 3>;
+					else if (px == 4 && py == 4 && st == 4) s.run = &step_max_pool<4, 4, 4>;
+				}
+				else if (dynamic_cast<dropout_layer*>(b)) s.run = &step_copy;
+				else if (dynamic_cast<softmax_layer*>(b)) s.run = &step_softmax;
+				if (s.run == &step_layer || Wbin[j]) { pinned.push_back(l->node.x); pinned.push_back(b->node.x); }
+			}
+		}
+		for (int i = 0; i < (int)p.steps.size(); i++) if (!p.steps[i].parts) p.split(p.steps[i]);
+		if (share_activations) p.share_activations(nodes, pinned);
+	}
+
 	// performs forward pass and returns class index
 	// do not delete or modify the returned pointer. it is a live pointer to the last layer in the network
 	// if calling over multiple threads, provide the thread index since the interal data is not otherwise thread safe
@@ -378,6 +977,22 @@ public:
 		return max_index(out, out_size());
 	}
 
+	// predicts the class of the first n samples (all for n<0) on the thread pool (set_threads).
+	// samples are handed out chunk at a time and idle threads steal chunks from busy ones
+	std::vector<int> predict_many(const std::vector<std::vector<float>> &data, int n = -1, int chunk = 16)
+	{
+		if (n < 0 || n > (int)data.size()) n = (int)data.size();
+		std::vector<int> classes(n);
+		if ((int)layer_sets.size() < get_threads()) allow_threads(get_threads());
+		auto run = [&](int begin, int end, int thread)
+		{
+			for (int k = begin; k < end; k++) classes[k] = predict_class(data[k].data(), thread);
+		};
+		if (_pool) _pool->parallel_for(n, chunk, run);
+		else run(0, n, 0);
+		return classes;
+	}
+
 	// the main forward pass 
 	// if calling over multiple threads, provide the thread index since the interal data is not otherwise thread safe
 	// train parameter is used to designate the forward pass is used in training (it turns on dropout layers, etc..)
@@ -387,20 +1002,32 @@ public:
 		if (_thread_number > _thread_count) bail("needed to call allow_threads()");
 		if (_thread_number >= (int)layer_sets.size()) bail("needed to call allow_threads()");
 
+		if (!_train && _thread_number < (int)plans.size()) return plans[_thread_number].run(in);
+		return forward_layers(layer_sets[_thread_number], in, _train);
+	}
+
+	// forward pass through a layer set, reading only the model (W, ..) so sets can run concurrently
+	float* forward_layers(std::vector<base_layer *> &layers, const float *in, int _train=0)
+	{
 		// clear nodes to zero 
-		__for__(auto layer __in__ layer_sets[_thread_number]) layer->node.fill(0.f); 
+		__for__(auto layer __in__ layers) layer->node.fill(0.f); 
 
 		// first layer assumed input. copy input to it 
-		for (int i = 0; i < layer_sets[_thread_number][0]->node.size(); i++)
-			layer_sets[_thread_number][0]->node.x[i] = in[i];
-		//memcpy(layer_sets[_thread_number][0]->node.x, in, 
-		//	sizeof(float)*layer_sets[_thread_number][0]->node.size());
+		for (int i = 0; i < layers[0]->node.size(); i++)
+			layers[0]->node.x[i] = in[i];
+		//memcpy(layers[0]->node.x, in, 
+		//	sizeof(float)*layers[0]->node.size());
+
+		// activations as planned by optimize_for_inference (not when training, backprop needs the activated nodes)
+		const bool planned = !_train && activation_source.size() == layers.size();
 
 		// for all layers
-		__for__(auto layer __in__ layer_sets[_thread_number])
+		for (int k = 0; k < (int)layers.size(); k++)
 		{
+			base_layer *layer = layers[k];
 			// add bias and activate these outputs (they should all be summed up from other branches at this point)
-			layer->activate_nodes(); 
+			if (!planned || activation_source[k] == k) layer->activate_nodes(); 
+			else if (activation_source[k] >= 0) ((convolution_layer*)layers[activation_source[k]])->activate_pooled(layer->node);
 
 			// send output signal downstream (note in this code 'top' is input layer, 'bottom' is output - bucking tradition
 			__for__ (auto &link __in__ layer->forward_linked_layers)
@@ -411,17 +1038,19 @@ public:
 				int connection_index = link.first; 
 				base_layer *p_bottom = link.second;
 				// weight distribution of the signal to layers under it
-				p_bottom->accumulate_signal(*layer, *W[connection_index], _train);
+				if (Wbin[connection_index]) p_bottom->accumulate_signal_binary(*layer, *Wbin[connection_index], _train);
+				else if (Wsparse[connection_index]) p_bottom->accumulate_signal_sparse(*layer, *Wsparse[connection_index], _train);
+				else if (W16[connection_index]) p_bottom->accumulate_signal_half(*layer, *W16[connection_index], _train);
+				else p_bottom->accumulate_signal(*layer, *W[connection_index], _train);
 			}
 
 		}
 		// return pointer to float * result from last layer
-		return layer_sets[_thread_number][layer_sets[_thread_number].size()-1]->node.x;
+		return layers[layers.size()-1]->node.x;
 	}
 
-	// write parameters to stream/file
-	// note that this does not persist intermediate training information that could be needed to 'pickup where you left off'
-	bool write(std::ofstream ofs, bool binary=false) 
+	// write the layer definitions and connection graph (first part of a model file)
+	void write_graph(std::ostream &ofs)
 	{
 		// save layers
 		ofs<<(int)layer_sets[MAIN_LAYER_SET].size()<<std::endl;
@@ -432,8 +1061,55 @@ public:
 		ofs<<(int)layer_graph.size()<<std::endl;
 		for(int j=0; j<(int)layer_graph.size(); j++)
 			ofs<<layer_graph[j].first << std::endl << layer_graph[j].second << std::endl;
+	}
+
+	// write parameters to stream/file
+	// note that this does not persist intermediate training information that could be needed to 'pickup where you left off'
+	bool write(std::ofstream ofs, bool binary=false) 
+	{
+		write_graph(ofs);
 
-		if(binary)
+		// 16 bit weights are always binary. sparse ones only when binary was asked for (text zeros are small already)
+		std::vector<int> storage(W.size());
+		bool tagged = false;
+		for(int j=0; j<(int)W.size(); j++)
+		{
+			storage[j] = W_precision[j];
+			if (Wsparse[j]) storage[j] = STORAGE_BLOCK_SPARSE;
+			else if (storage[j] == PRECISION_FP32 && binary && W[j]->size() > 1 && dynamic_cast<fully_connected_layer*>(bottom_layer(j))
+				&& block_sparse_matrix::block_density(*W[j]) <= sparse_max_density) storage[j] = STORAGE_BLOCK_SPARSE;
+			if (storage[j] != PRECISION_FP32) tagged = true;
+		}
+		if (tagged)
+		{
+			// binary with a storage tag per connection, then the data
+			ofs<<(int)3<<std::endl;
+			for(int j=0; j<(int)layer_sets[MAIN_LAYER_SET].size(); j++)
+				ofs.write((char*)layer_sets[MAIN_LAYER_SET][j]->bias.x, layer_sets[MAIN_LAYER_SET][j]->bias.size()*sizeof(float));
+			for(int j=0; j<(int)W.size(); j++)
+			{
+				const int p = storage[j];
+				ofs.write((char*)&p, sizeof(int));
+				if (p == PRECISION_FP32) ofs.write((char*) W[j]->x, W[j]->size()*sizeof(float));
+				else if (p == STORAGE_BLOCK_SPARSE)
+				{
+					block_sparse_matrix *sp = Wsparse[j] ? Wsparse[j] : new block_sparse_matrix(*W[j]);
+					const int blocks = sp->blocks();
+					ofs.write((char*)&blocks, sizeof(int));
+					ofs.write((char*)sp->row_start.data(), sp->row_start.size()*sizeof(int));
+					ofs.write((char*)sp->block_col.data(), sp->block_col.size()*sizeof(int));
+					ofs.write((char*)sp->val.data(), sp->val.size()*sizeof(float));
+					if (sp != Wsparse[j]) delete sp;
+				}
+				else if (W16[j]) ofs.write((char*) W16[j]->x.data(), W16[j]->size()*sizeof(unsigned short));
+				else 
+				{
+					half_matrix h(*W[j], p);
+					ofs.write((char*) h.x.data(), h.size()*sizeof(unsigned short));
+				}
+			}
+		}
+		else if(binary)
 		{
 			ofs<<(int)1<<std::endl;
 			// binary version to save space if needed
@@ -466,12 +1142,12 @@ public:
 	}
 	bool write(std::string &filename, bool binary = false) { return write(std::ofstream(filename.c_str()), binary); }
 
-	// read network from a file/stream
-	bool read(std::istream &ifs)
+	// read the layer definitions and connection graph, building the network. returns the layer count
+	int read_graph(std::istream &ifs)
 	{
-		if(!ifs.good()) return false;
+		if(!ifs.good()) return 0;
 		// read layer def
-		int layer_count;
+		int layer_count=0;
 		ifs>>layer_count;
 
 		std::string s;
@@ -501,13 +1177,56 @@ public:
 			replace_str(layer_name2, "\r", "");
 			connect(layer_name1.c_str(),layer_name2.c_str());
 		}
+		return layer_count;
+	}
+
+	// read network from a file/stream
+	bool read(std::istream &ifs)
+	{
+		if(!ifs.good()) return false;
+		int layer_count=read_graph(ifs);
+		if(layer_count<1) return false;
 
+		std::string s;
 		int binary;
 		ifs>>binary;
 		getline(ifs,s); // get endline
+		// anything else (quantized, ..) needs to be loaded by its own reader
+		if(binary!=0 && binary!=1 && binary!=3) return false;
 
+		if(binary==3)
+		{
+			for(int j=0; j<(int)layer_sets[MAIN_LAYER_SET].size(); j++)
+				ifs.read((char*)layer_sets[MAIN_LAYER_SET][j]->bias.x, layer_sets[MAIN_LAYER_SET][j]->bias.size()*sizeof(float));
+			for(int j=0; j<(int)W.size(); j++)
+			{
+				int p = PRECISION_FP32;
+				ifs.read((char*)&p, sizeof(int));
+				if (p == PRECISION_FP32) { ifs.read((char*) W[j]->x, W[j]->size()*sizeof(float)); continue; }
+				if (p == STORAGE_BLOCK_SPARSE)
+				{
+					block_sparse_matrix *sp = new block_sparse_matrix(W[j]->cols, W[j]->rows);
+					int blocks = 0;
+					ifs.read((char*)&blocks, sizeof(int));
+					sp->block_col.resize(blocks);
+					sp->val.resize(blocks * 16);
+					ifs.read((char*)sp->row_start.data(), sp->row_start.size()*sizeof(int));
+					ifs.read((char*)sp->block_col.data(), sp->block_col.size()*sizeof(int));
+					ifs.read((char*)sp->val.data(), sp->val.size()*sizeof(float));
+					if (_optimizer) { sp->to_dense(*W[j]); delete sp; }
+					else { Wsparse[j] = sp; delete W[j]; W[j] = new matrix(); }
+					continue;
+				}
+				W_precision[j] = p;
+				half_matrix *h = new half_matrix(*W[j], p);
+				ifs.read((char*) h->x.data(), h->size()*sizeof(unsigned short));
+				// training needs the float master copy, inference runs from the 16 bit one
+				if (_optimizer) { h->widen(*W[j]); delete h; }
+				else { W16[j] = h; delete W[j]; W[j] = new matrix(); }
+			}
+		}
 		// binary version to save space if needed
-		if(binary)
+		else if(binary)
 		{
 			for(int j=0; j<(int)layer_sets[MAIN_LAYER_SET].size(); j++)
 				ifs.read((char*)layer_sets[MAIN_LAYER_SET][j]->bias.x, layer_sets[MAIN_LAYER_SET][j]->bias.size()*sizeof(float));
@@ -532,6 +1251,8 @@ public:
 		}
 		// copies batch=0 stuff to other batches
 		sync_layer_sets();
+		update_sparse_weights();
+		update_binary_weights();
 
 		return true;
 	}
@@ -549,18 +1270,120 @@ public:
 
 #ifndef NO_TRAINING_CODE  // this is surely broke by now and will need to be fixed
 
-	// resets the state of all batches to 'free' state
-	void reset_mini_batch() { memset(batch_open.data(), BATCH_FREE, batch_open.size()); }
+	int batch_banks() { return _staleness + 1; }
+	unsigned int open_batch() { return (unsigned int)(_batch_ticket.load() >> 32); }
+
+	// resets the state of all slots to 'free' state and opens batch n, with no chunks out yet. the batch that
+	// used its bank before has been applied
+	void reset_mini_batch(unsigned int n)
+	{
+		for (int i = 0; i < (int)batch_open.size(); i++) batch_open[i].store(BATCH_FREE);
+		_batch_done = 0;
+		_batch_skipped = 0;
+		const int bank = n % batch_banks();
+		const int layer_cnt = (int)_layer_chunks_end.size();
+		for (int k = 0; k < layer_cnt; k++) _layer_done[bank*layer_cnt + k] = 0;
+		_sync_done[bank] = 0;
+		_sync_job[bank] = (unsigned long long)n << 32;
+		_sync_claim[bank] = (unsigned long long)n << 32;
+		// last, it lets the samples waiting for a slot go
+		_batch_ticket = (unsigned long long)n << 32;
+	}
+
+	// samples of the next batches run against weights missing at most this many closed batches. 0 applies each
+	// batch before the next one starts. more lets threads keep going through the update at the cost of a bank of
+	// gradient sets each, and races between the update and the next samples' passes like hogwild has.
+	// switch between epochs only
+	int get_staleness() { return _staleness; }
+	void set_staleness(int batches) { _staleness = batches < 0 ? 0 : batches; }
 	
 	// sets up number of mini batches (storage for sets of weight deltas)
 	void set_mini_batch_size(int batch_cnt)
 	{
 		if (batch_cnt<1) batch_cnt = 1;
 		_batch_size = batch_cnt;
-		dW_sets.resize(_batch_size);
-		dbias_sets.resize(_batch_size);
-		batch_open.resize(_batch_size); 
-		reset_mini_batch();
+		resize_batch_slots(); 
+	}
+
+	// a zeroed gradient set per layer set and bank, sized like the weights and nodes. sets already the right
+	// size are kept, they are zero between updates. nothing may be in flight
+	void resize_gradient_sets()
+	{
+		const int banks = batch_banks();
+		const int sets = (int)layer_sets.size()*banks;
+		const int layer_cnt = (int)layer_sets[MAIN_LAYER_SET].size();
+		dW_sets.resize(sets);
+		dbias_sets.resize(sets);
+		for (int i = 0; i < sets; i++)
+		{
+			dW_sets[i].resize(W.size());
+			for (int j = 0; j < (int)W.size(); j++)
+			{
+				matrix &dw = dW_sets[i][j];
+				if (dw.cols == W[j]->cols && dw.rows == W[j]->rows && dw.chans == W[j]->chans) continue;
+				dw.resize(W[j]->cols, W[j]->rows, W[j]->chans);
+				dw.fill(0);
+			}
+			dbias_sets[i].resize(layer_cnt);
+			for (int k = 0; k < layer_cnt; k++)
+			{
+				const matrix &d = layer_sets[MAIN_LAYER_SET][k]->delta;
+				matrix &db = dbias_sets[i][k];
+				if (db.cols == d.cols && db.rows == d.rows && db.chans == d.chans) continue;
+				db.resize(d.cols, d.rows, d.chans);
+				db.fill(0);
+			}
+		}
+
+		// into gradient_arena, unless already there with this layout
+		std::vector<matrix *> m;
+		size_t floats = 0;
+		bool packed = true;
+		for (int i = 0; i < sets; i++)
+		{
+			for (int j = 0; j < (int)dW_sets[i].size(); j++) m.push_back(&dW_sets[i][j]);
+			for (int k = 0; k < layer_cnt; k++) m.push_back(&dbias_sets[i][k]);
+		}
+		__for__(auto g __in__ m)
+		{
+			floats += float_arena::padded(g->size());
+			if (g->size() && !gradient_arena.contains(*g)) packed = false;
+		}
+		if (!packed || floats != gradient_arena.size()) gradient_arena.pack(m);
+
+		// the update chunks, in backward order
+		_sync_chunks.clear();
+		_layer_chunks_end.assign(layer_cnt, 0);
+		for (int k = layer_cnt - 1; k >= 0; k--)
+		{
+			base_layer *layer = layer_sets[MAIN_LAYER_SET][k];
+			__for__(auto &link __in__ layer->backward_linked_layers)
+			{
+				const int w_index = (int)link.first;
+				const int size = W[w_index]->size();
+				for (int begin = 0; begin < size; begin += SYNC_CHUNK_SIZE)
+				{
+					sync_chunk c = { k, w_index, begin, begin + SYNC_CHUNK_SIZE < size ? begin + SYNC_CHUNK_SIZE : size };
+					_sync_chunks.push_back(c);
+				}
+			}
+			if (dynamic_cast<convolution_layer*> (layer) == NULL)
+			{
+				sync_chunk c = { k, -1, 0, 0 };
+				_sync_chunks.push_back(c);
+			}
+			_layer_chunks_end[k] = (int)_sync_chunks.size();
+		}
+		std::vector< std::atomic<int> > layer_done(banks*layer_cnt), sync_done(banks);
+		std::vector< std::atomic<unsigned long long> > job(banks), claim(banks);
+		_layer_done.swap(layer_done);
+		_sync_done.swap(sync_done);
+		_sync_job.swap(job);
+		_sync_claim.swap(claim);
+		for (int b = 0; b < banks; b++) { _sync_job[b] = 0; _sync_claim[b] = 0; }
+		// the open batch starts over in its bank, all before it are applied
+		_batches_applied = open_batch();
+		reset_mini_batch(open_batch());
 	}
 	
 	int get_mini_batch_size() { return _batch_size; }
@@ -574,7 +1397,7 @@ public:
 		int filled = 0;
 		for (int i = 0; i<batch_open.size(); i++)
 		{
-			if (batch_open[i] == BATCH_FREE) return i;
+			if (batch_open[i] == BATCH_FREE || batch_open[i] == BATCH_SKIPPED) return i;
 			if (batch_open[i] == BATCH_RESERVED) reserved++;
 			if (batch_open[i] == BATCH_COMPLETE) filled++;
 		}
@@ -584,99 +1407,190 @@ public:
 		bail("threading error"); // should not get here  unless threading problem
 	}
 
-	// apply all weights to first set of dW, then apply to model weights 
+	// apply all weights to first set of dW, then apply to model weights. this is for the open batch, done or not,
+	// with no sample in flight (end_epoch)
 	void sync_mini_batch()
 	{
 		// need to ensure no batches in progress (reserved)
 		int next = get_next_open_batch();
 		if (next == BATCH_FILLED_IN_PROCESS) bail("thread lock");
 
-		int layer_cnt = (int)layer_sets[MAIN_LAYER_SET].size();
-
-		base_layer *layer;
+		const unsigned int n = open_batch();
+		wait_applied(n);
+		apply_mini_batch(n);
+		// prepare to start mini batch over
+		reset_mini_batch(n + 1);
+	}
 
-		 // sum contributions 
-		for (int k = layer_cnt - 1; k >= 0; k--)
+	// the sample completing batch n. with staleness the next batch opens first (once its bank is free),
+	// so threads keep going while this one is applied
+	void close_mini_batch(unsigned int n)
+	{
+		if (_staleness > 0)
 		{
-			layer = layer_sets[MAIN_LAYER_SET][k];
-			__for__(auto &link __in__ layer->backward_linked_layers)
-			{
-				int w_index = (int)link.first;
-				// if batch free, then make sure it is zero'd out because we will increment dW set [0]
-				if (batch_open[0] == BATCH_FREE) dW_sets[0][w_index].fill(0);
-				for (int b = 1; b< _batch_size; b++)
-				{
-					if (batch_open[b] == BATCH_COMPLETE) dW_sets[0][w_index] += dW_sets[b][w_index];
-				}
-			}
-			if (dynamic_cast<convolution_layer*> (layer) != NULL)  continue;
-
-			// bias stuff... that needs to be fixed for conv layers perhaps
-			if (batch_open[0] == BATCH_FREE) dbias_sets[0][k].fill(0);
-			for (int b = 1; b< _batch_size; b++)
-			{
-				if (batch_open[b] == BATCH_COMPLETE) dbias_sets[0][k] += dbias_sets[b][k];
-			}
+			wait_applied(n + 2 - batch_banks());
+			reset_mini_batch(n + 1);
 		}
+		wait_applied(n);
+		apply_mini_batch(n);
+		if (_staleness == 0) reset_mini_batch(n + 1);
+	}
 
-		// update weights
-		for (int k = layer_cnt - 1; k >= 0; k--)
+	// helps with updates until batches before n are applied
+	void wait_applied(unsigned int n)
+	{
+		while ((int)(_batches_applied.load() - n) < 0) { help_sync(); std::this_thread::yield(); }
+	}
+
+	// batch n's update. the ones before it are applied
+	void apply_mini_batch(unsigned int n)
+	{
+		const int bank = n % batch_banks();
+		// layers the whole batch was past went out during backward (see train_class), the rest go now
+		const int chunks = (int)_sync_chunks.size();
+		publish_sync_chunks(bank, chunks);
+		help_sync();
+		while (_sync_done[bank].load() < chunks) std::this_thread::yield();
+
+		update_binary_weights();
+
+		train_updates++; // could have no updates .. so this is not exact
+		sync_layer_sets();
+		_batches_applied = n + 1;
+	}
+
+	// lets the bank's chunks before end go
+	void publish_sync_chunks(int bank, int end)
+	{
+		unsigned long long job = _sync_job[bank].load();
+		while ((unsigned int)job < (unsigned int)end &&
+			!_sync_job[bank].compare_exchange_weak(job, (job & 0xffffffff00000000ull) | (unsigned int)end));
+	}
+
+	// sums one chunk of the bank's thread deltas into its first set, steps the weights (or bias) and zeroes
+	// the chunk for the bank's next batch
+	void sync_chunk_update(const sync_chunk &c, int bank)
+	{
+		const int threads = (int)layer_sets.size();
+		const int first = bank*threads;
+		if (c.w_index < 0)
 		{
-			layer = layer_sets[MAIN_LAYER_SET][k];
-			__for__(auto &link __in__ layer->backward_linked_layers)
+			// bias stuff... that needs to be fixed for conv layers perhaps
+			const int k = c.layer;
+			matrix &db = dbias_sets[first][k];
+			for (int i = first + 1; i < first + threads; i++)
 			{
-				int w_index = (int)link.first;
-				if (dW_sets[MAIN_LAYER_SET][w_index].size() > 0)
-					_optimizer->increment_w(W[w_index], w_index, dW_sets[MAIN_LAYER_SET][w_index]);  // -- 10%
-
+				db += dbias_sets[i][k];
+				dbias_sets[i][k].fill(0);
 			}
-			if (dynamic_cast<convolution_layer*> (layer) != NULL)  continue;
+			base_layer *layer = layer_sets[MAIN_LAYER_SET][k];
 			for (int j = 0; j<layer->bias.size(); j++)
-				layer->bias.x[j] -= dbias_sets[0][k].x[j] * _optimizer->learning_rate;
+				layer->bias.x[j] -= db.x[j] * _optimizer->learning_rate;
+			db.fill(0);
+			return;
 		}
+		float *dw = dW_sets[first][c.w_index].x;
+		const size_t bytes = sizeof(float)*(c.end - c.begin);
+		for (int i = first + 1; i < first + threads; i++)
+		{
+			float *src = dW_sets[i][c.w_index].x;
+			for (int s = c.begin; s < c.end; s++) dw[s] += src[s];
+			memset(src + c.begin, 0, bytes);
+		}
+		_optimizer->increment_w(W[c.w_index], c.w_index, dW_sets[first][c.w_index], c.begin, c.end);  // -- 10%
+		memset(dw + c.begin, 0, bytes);
+	}
 
-		// prepare to start mini batch over
-		reset_mini_batch();
-		train_updates++; // could have no updates .. so this is not exact
-		sync_layer_sets();
+	// runs chunks of the oldest batch not applied that are out, until none are left to claim. a claim only
+	// succeeds on the (batch, chunk) it saw, so chunks going out later are never claimed past
+	void help_sync()
+	{
+		if (_sync_job.empty()) return;
+		while (true)
+		{
+			const unsigned int n = _batches_applied.load();
+			const int bank = n % batch_banks();
+			const unsigned long long job = _sync_job[bank].load();
+			unsigned long long seen = _sync_claim[bank].load();
+			if ((unsigned int)(job >> 32) != n || (seen >> 32) != (job >> 32) || (unsigned int)seen >= (unsigned int)job) return;
+			if (!_sync_claim[bank].compare_exchange_weak(seen, seen + 1)) continue;
+			sync_chunk_update(_sync_chunks[(unsigned int)seen], bank);
+			_sync_done[bank]++;
+		}
 	}
 
 	// reserve_next.. is used to reserve a space in the minibatch for the existing training sample
-	int reserve_next_batch()
+	// slots given back by skipped samples are taken first, otherwise the next ticket. when the batch is full
+	// this waits (no lock, no sleep, helping with updates) for the sample finishing it to open the next one.
+	// batch is the batch the slot is in
+	int reserve_next_batch(unsigned int &batch)
 	{
-		lock_batch();
-		int my_batch_index = -3;
-		while (my_batch_index < 0)
+		while (true)
 		{
-			my_batch_index = get_next_open_batch();
-
-			if (my_batch_index >= 0) // valid index
-			{
-				batch_open[my_batch_index] = BATCH_RESERVED;
-				unlock_batch();
-				return my_batch_index;
-			}
-			else if (my_batch_index == BATCH_FILLED_COMPLETE) // all index are complete
+			if (_batch_skipped.load() > 0)
+				for (int i = 0; i < _batch_size; i++)
+				{
+					unsigned char skipped = BATCH_SKIPPED;
+					// the batch can not close while the slot is not complete, so it is the open one
+					if (batch_open[i].compare_exchange_strong(skipped, BATCH_RESERVED)) { _batch_skipped--; batch = open_batch(); return i; }
+				}
+			// a waiter that lost a given back slot to another comes round again, so only draw while tickets are left
+			unsigned long long ticket = _batch_ticket.load();
+			if ((unsigned int)ticket < (unsigned int)_batch_size) ticket = _batch_ticket++;
+			if ((unsigned int)ticket < (unsigned int)_batch_size)
 			{
-				sync_mini_batch(); // resets _batch_index to 0
-				my_batch_index = get_next_open_batch();
-				batch_open[my_batch_index] = BATCH_RESERVED;
-				unlock_batch();
-				return my_batch_index;
+				batch_open[(unsigned int)ticket].store(BATCH_RESERVED);
+				batch = (unsigned int)(ticket >> 32);
+				return (int)(unsigned int)ticket;
 			}
-			// need to wait for ones in progress to finish
-			unlock_batch();
-			ucnn_sleep(1);
-			lock_batch();
+			while ((_batch_ticket.load() >> 32) == (ticket >> 32) && _batch_skipped.load() <= 0) { help_sync(); std::this_thread::yield(); }
 		}
-		return -3;
+	}
+
+	// marks the slot done. the sample completing the batch closes it
+	void complete_batch(int my_batch_index, unsigned int batch)
+	{
+		batch_open[my_batch_index].store(BATCH_COMPLETE);
+		if (++_batch_done == _batch_size) close_mini_batch(batch);
 	}
 
 	float get_learning_rate() {if(!_optimizer) bail("set optimizer"); return _optimizer->learning_rate;}
 	void set_learning_rate(float alpha) {if(!_optimizer) bail("set optimizer"); _optimizer->learning_rate=alpha;}
-	void reset_optimizer() {if(!_optimizer) bail("set optimizer"); _optimizer->reset();}
+	void reset_optimizer() {if(!_optimizer) bail("set optimizer"); _optimizer->reset(); __for__(auto o __in__ _hogwild_optimizers) o->reset();}
+	// keep the optimizer's per weight state (the adam, adagrad and rmsprop moments) as "bf16", halving its memory
+	// and the traffic of each update, or "fp32". bf16 moments are rounded stochastically. "fp16" is refused,
+	// squared gradients fall below its range
+	bool set_optimizer_precision(const char *precision)
+	{
+		if(!_optimizer) bail("set optimizer");
+		const int p = precision_from_name(precision);
+		if (!_optimizer->set_state_precision(p)) return false;
+		__for__(auto o __in__ _hogwild_optimizers) o->set_state_precision(p);
+		return true;
+	}
+	// hogwild: every sample's gradient goes straight into the shared weights and biases, no mini batch slots
+	// and no sync, and the threads race on the weights (benign, each write is one float of a small step).
+	// for wide fully connected models where syncing costs more than it saves. adaptive optimizers keep their
+	// state per thread. switch between epochs only. binary layers are clipped and repacked by each thread
+	// after a mini batch worth of its own samples
+	bool get_hogwild() { return _hogwild; }
+	void set_hogwild(bool hogwild) { _hogwild = hogwild; }
 	bool get_smart_training() {return _smart_train;}
 	void set_smart_training(bool _use_train) { _smart_train = _use_train;}
+	// keeps a record (energy, epoch, correct: 8 bytes) per training sample so later epochs pass over easy samples
+	// without a forward pass. a sample smart training skipped k times in a row is passed over for the next k
+	// epochs (at most max_skip_epochs), then runs again to be looked at afresh, so the skip level falling as the
+	// model improves reaches it within max_skip_epochs. passed over samples count as skipped, with their last
+	// energy in the statistics. needs smart training and sample indices: train_epoch passes them and sizes the
+	// cache to its samples, or see train_class. 0 samples turns it off. records are kept by the sample's position
+	// in the training set, so shuffling the samples between epochs gives them each other's records: shuffle an
+	// index into them instead, or turn the cache off
+	void set_sample_cache(int samples, int max_skip_epochs = 8)
+	{
+		_sample_cache.assign(samples < 0 ? 0 : samples, sample_record());
+		_sample_cache_max_skip = max_skip_epochs < 1 ? 1 : (max_skip_epochs > 255 ? 255 : max_skip_epochs);
+	}
+	int get_sample_cache() { return (int)_sample_cache.size(); }
 	float get_smart_train_level() { return _skip_energy_level; }
 	void set_smart_train_level(float _level) { _skip_energy_level = _level; }
 	void set_max_epochs(int max_e) { if (max_e <= 0) max_e = 1; max_epochs = max_e; }
@@ -696,11 +1610,26 @@ public:
 	// call before starting training for current epoch
 	void start_epoch(std::string loss_function="mse")
 	{
+		if (_cost_function) delete _cost_function;
 		_cost_function=new_cost_function(loss_function);
+		if (_cost_function == NULL) bail("unknown cost function");
+		_cost_activation_type = 0;
+		base_layer *out_layer = layer_sets[MAIN_LAYER_SET][layer_sets[MAIN_LAYER_SET].size() - 1];
+		if (std::string("cross_entropy").compare(_cost_function->name) == 0)
+		{
+			if (std::string("sigmoid").compare(out_layer->p_act->name) == 0) _cost_activation_type = 1;
+			else if (std::string("tanh").compare(out_layer->p_act->name) == 0) _cost_activation_type = 2;
+		}
+		_softmax_cost = 0;
+		if (dynamic_cast<softmax_layer*>(out_layer))
+			_softmax_cost = std::string("cross_entropy").compare(_cost_function->name) == 0 ? 2 : 1;
 		train_correct = 0;
 		train_skipped = 0;
 		train_updates = 0;
 		train_samples = 0;
+		reset_smart_stats();
+		resize_gradient_sets();
+		if (_hogwild) make_hogwild_state();
 		if (epoch_count == 0) reset_optimizer();
 	
 		// accuracy not improving .. slow learning
@@ -720,8 +1649,29 @@ public:
 		old_estimated_accuracy = estimated_accuracy;
 		estimated_accuracy = 0;
 		//_skip_energy_level = 0.05;
-		_running_sum_E = 0;
 	}
+
+	// zeroes the epoch's counts, all the statistics when the number of layer sets changed. the energies carry
+	// over into the next epoch
+	void reset_smart_stats()
+	{
+		const int threads = (int)layer_sets.size();
+		if ((int)_smart_stats.size() != threads)
+		{
+			std::vector<smart_stats> stats(threads);
+			_smart_stats.swap(stats);
+			__for__(auto &st __in__ _smart_stats)
+			{
+				for (int i = 0; i < SMART_BINS; i++) st.bins[i] = 0;
+				st.sum_E = 0;
+				st.due = smart_share();
+			}
+			_smart_merged.assign(SMART_BINS, 0);
+			_smart_merged_E = 0;
+		}
+		__for__(auto &st __in__ _smart_stats) st.samples = st.correct = st.skipped = 0;
+	}
+	int smart_share() { const int n = SMART_TRAIN_SAMPLE_SIZE / (int)layer_sets.size(); return n < 1 ? 1 : n; }
 	
 	// time to stop?
 	bool elvis_left_the_building()
@@ -735,7 +1685,19 @@ public:
 	bool end_epoch()
 	{
 		// run leftovers through mini-batch
-		sync_mini_batch();
+		if (!_hogwild) sync_mini_batch();
+		else
+		{
+			update_binary_weights();
+			train_updates += _hogwild_updates.exchange(0);
+		}
+		__for__(auto &st __in__ _smart_stats)
+		{
+			train_samples += st.samples;
+			train_correct += st.correct;
+			train_skipped += st.skipped;
+			st.samples = st.correct = st.skipped = 0;
+		}
 		epoch_count++;
 
 		// estimate accuracy of validation run 
@@ -752,62 +1714,183 @@ public:
 		return elvis_left_the_building();
 	}
 
-	void update_smart_train(const float E, bool correct)
+	// 8 bins per octave of E from 2^-30 (the exponent and top 3 mantissa bits), clamped at both ends
+	static int smart_bin(const float E)
+	{
+		if (E <= 0) return 0;
+		unsigned int x; memcpy(&x, &E, 4);
+		const int b = (int)(x >> 20) - ((127 - 30) << 3);
+		return b < 0 ? 0 : (b >= SMART_BINS ? SMART_BINS - 1 : b);
+	}
+	// lowest E of bin b
+	static float smart_bin_floor(const int b)
 	{
+		const unsigned int x = (unsigned int)(b + ((127 - 30) << 3)) << 20;
+		float f; memcpy(&f, &x, 4);
+		return f;
+	}
 
-#ifdef UCNN_OMP	
-#pragma omp critical
-#endif
-		{
-			train_samples++;
-			if (correct) train_correct++;
+	// skipped: the sample was passed over without running (see set_sample_cache), so it counts as skipped
+	// whatever its last energy is against the current level
+	void update_smart_train(const float E, bool correct, int thread, bool skipped = false)
+	{
+		smart_stats &st = _smart_stats[thread];
+		st.samples++;
+		if (correct) st.correct++;
 
-			if (_smart_train)
+		if (_smart_train)
+		{
+			// only this thread writes them, others just read
+			std::atomic<unsigned int> &bin = st.bins[smart_bin(E)];
+			bin.store(bin.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			st.sum_E.store(st.sum_E.load(std::memory_order_relaxed) + E, std::memory_order_relaxed);
+			if (--st.due <= 0)
 			{
-				_running_E.push_back(E);
-				_running_sum_E += E;
-				const int SMART_TRAIN_SAMPLE_SIZE = 1000;
-
-				int s = (int)_running_E.size();
-				if (s >= SMART_TRAIN_SAMPLE_SIZE)
-				{
-					_running_sum_E /= (double)s;
-					std::sort(_running_E.begin(), _running_E.end());
-					float top_fraction = (float)_running_sum_E*10.f;
-					if (top_fraction > 0.8f) top_fraction = 0.8f;
-					if (top_fraction < 0.03f) top_fraction = 0.03f;
-					int index = s - 1 - (int)(top_fraction*(s - 1));
-
-					if (_running_E[index] > 0) _skip_energy_level = _running_E[index];
-
-					_running_E.clear();
-				}
+				st.due = smart_share();
+				merge_smart_train();
 			}
-			if (E > 0 && E < _skip_energy_level)
+		}
+		if (skipped || (E > 0 && E < _skip_energy_level))
+		{
+			//std::cout << "E=" << E;
+			st.skipped++;
+		}
+	}
+
+	// the skip level from the energies all threads saw since the last merge, once there are enough of them:
+	// the mean picks the fraction to keep training on, the level is the energy that many samples are above.
+	// a thread finding another one merging goes on and tries again after its next share
+	void merge_smart_train()
+	{
+		if (_smart_merging.exchange(true)) return;
+		_smart_totals.assign(SMART_BINS, 0);
+		double sum_E = 0;
+		__for__(auto &st __in__ _smart_stats)
+		{
+			for (int i = 0; i < SMART_BINS; i++) _smart_totals[i] += st.bins[i].load(std::memory_order_relaxed);
+			sum_E += st.sum_E.load(std::memory_order_relaxed);
+		}
+		int s = 0;
+		for (int i = 0; i < SMART_BINS; i++) s += (int)(_smart_totals[i] - _smart_merged[i]);
+		if (s >= SMART_TRAIN_SAMPLE_SIZE)
+		{
+			float top_fraction = (float)((sum_E - _smart_merged_E) / (double)s)*10.f;
+			if (top_fraction > 0.8f) top_fraction = 0.8f;
+			if (top_fraction < 0.03f) top_fraction = 0.03f;
+			// rank of the level in ascending order, found by walking the bins and placed evenly inside its bin
+			const int index = s - 1 - (int)(top_fraction*(s - 1));
+			int below = 0;
+			for (int i = 0; i < SMART_BINS; i++)
 			{
-				//std::cout << "E=" << E;
-				train_skipped++;
+				const int n = (int)(_smart_totals[i] - _smart_merged[i]);
+				if (below + n <= index) { below += n; continue; }
+				const float lo = smart_bin_floor(i), hi = smart_bin_floor(i + 1);
+				const float level = lo + (hi - lo)*((float)(index - below) + 0.5f) / (float)n;
+				if (level > 0) _skip_energy_level = level;
+				break;
 			}
+			_smart_merged.swap(_smart_totals);
+			_smart_merged_E = sum_E;
+		}
+		_smart_merging.store(false);
+	}
 
-		}  // omp critical
+	// per thread optimizers for hogwild, made again when threads or connections changed
+	void make_hogwild_state()
+	{
+		if (_hogwild_optimizers.size() == layer_sets.size() && _hogwild_connections == (int)W.size()) return;
+		__for__(auto o __in__ _hogwild_optimizers) delete o;
+		_hogwild_optimizers.clear();
+		for (int i = 0; i < (int)layer_sets.size(); i++)
+		{
+			optimizer *o = new_optimizer(_optimizer_name.c_str());
+			if (o == NULL) bail("set optimizer");
+			o->set_state_precision(_optimizer->get_state_precision());
+			__for__(auto w __in__ W) o->push_back(w->cols, w->rows, w->chans);
+			_hogwild_optimizers.push_back(o);
+		}
+		_hogwild_steps.assign(layer_sets.size(), 0);
+		_hogwild_connections = (int)W.size();
+		_hogwild_updates = 0;
+	}
 
+	// the hogwild step of a sample that went backward in thread_number's layer set
+	void hogwild_update(int thread_number)
+	{
+		optimizer *o = _hogwild_optimizers[thread_number];
+		o->learning_rate = _optimizer->learning_rate;
+		std::vector<matrix> &dW = dW_sets[thread_number];
+		for (int k = (int)layer_sets[thread_number].size() - 1; k >= 0; k--)
+		{
+			base_layer *layer = layer_sets[thread_number][k];
+			__for__(auto &link __in__ layer->backward_linked_layers)
+			{
+				const int w_index = (int)link.first;
+				dW[w_index].fill(0);
+				layer->calculate_dw(*link.second, dW[w_index]);
+				o->increment_w(W[w_index], w_index, dW[w_index]);
+			}
+			if (dynamic_cast<convolution_layer*> (layer) != NULL)  continue;
+			// the sets share the main set's bias
+			float *bias = layer_sets[MAIN_LAYER_SET][k]->bias.x;
+			for (int j = 0; j < layer->bias.size(); j++) bias[j] -= layer->delta.x[j] * o->learning_rate;
+		}
+		// there is no batch to repack after, so the binary layers are repacked as often as when syncing
+		if (++_hogwild_steps[thread_number] >= _batch_size)
+		{
+			_hogwild_steps[thread_number] = 0;
+			update_binary_weights();
+		}
+		_hogwild_updates++;
+	}
 
+	// one epoch (start_epoch, all samples, end_epoch) of the first n samples (all for n<0) on the thread pool
+	// (set_threads), no OpenMP needed. samples go out chunk at a time and idle threads steal chunks from busy ones.
+	// returns true when it is time to stop (see end_epoch). with a sample cache, data[i] uses record i, so keep
+	// data in the same order from epoch to epoch (see set_sample_cache)
+	bool train_epoch(const std::vector<std::vector<float>> &data, const std::vector<int> &labels, int n = -1,
+		std::string loss_function = "mse", int chunk = 16)
+	{
+		if (n < 0 || n > (int)data.size()) n = (int)data.size();
+		if ((int)layer_sets.size() < get_threads()) allow_threads(get_threads());
+		if (!_sample_cache.empty() && (int)_sample_cache.size() != n) set_sample_cache(n, _sample_cache_max_skip);
+		start_epoch(loss_function);
+		auto run = [&](int begin, int end, int thread)
+		{
+			for (int k = begin; k < end; k++) train_class((float *)data[k].data(), labels[k], thread, k);
+		};
+		if (_pool) _pool->parallel_for(n, chunk, run);
+		else run(0, n, 0);
+		return end_epoch();
 	}
 
 	// after starting epoch, call this to train against a class label
 	// label_index must be 0 to out_size()-1
 	// for thread safety, you must pass in the thread_index if calling from different threads
-	bool train_class(float *in, int label_index, int _thread_number = -1)
+	// sample is the sample's index in the training set, for the sample cache (see set_sample_cache). -1 for none
+	bool train_class(float *in, int label_index, int _thread_number = -1, int sample = -1)
 	{
 		if (_optimizer == NULL) bail("set optimizer");
 		if (_thread_number < 0) _thread_number = get_thread_num();
 		if (_thread_number > _thread_count)  bail("call allow_threads()");
+		if (_thread_number >= (int)layer_sets.size() || (int)dW_sets.size() != (int)layer_sets.size()*batch_banks())
+			bail("call start_epoch() after allow_threads()");
 
 		const int thread_number = _thread_number;
 
+		// passed over: easy the last times it ran and not due again yet. counted as it went then
+		sample_record *record = sample >= 0 && sample < (int)_sample_cache.size() ? &_sample_cache[sample] : NULL;
+		if (record && record->skips && _smart_train && record->correct
+			&& (unsigned short)(epoch_count - record->epoch) <= record->skips)
+		{
+			update_smart_train(record->E, true, thread_number, true);
+			return false;
+		}
+
 		// get next free mini_batch slot
 		// this is tied to the current state of the model
-		int my_batch_index = reserve_next_batch();
+		unsigned int my_batch = 0;
+		int my_batch_index = _hogwild ? 0 : reserve_next_batch(my_batch);
 		// out of data or an error if index is negative
 		if (my_batch_index < 0) return false;
 		// run through forward to get nodes activated
@@ -830,50 +1913,68 @@ public:
 		int max_j_out = 0;
 		int max_j_target = label_index;
 
-		// was passing this in, but may as well just create it on the fly
-		// a vector mapping the label index to the desired target output node values
-		// all -1 except target node 1
-		std::vector<float> target(layer_node_size, -1);
-		if(label_index>=0 && label_index<layer_node_size) target[label_index] = 1;
-
-
-		// because of numerator/demoninator cancellations which prevent a divide by zero issue, 
-		// we need to handle some things special on output layer
-		float cost_activation_type = 0;
-		if ((std::string("sigmoid").compare(layer->p_act->name) == 0) &&
-			(std::string("cross_entropy").compare(_cost_function->name) == 0)) 
-			cost_activation_type = 1;
-		else if ((std::string("tanh").compare(layer->p_act->name) == 0) &&
-			(std::string("cross_entropy").compare(_cost_function->name) == 0)) 
-			cost_activation_type = 2;
-	
-		for (int j = 0; j < layer_node_size; j++)
+		if (_softmax_cost)
 		{
-			if(cost_activation_type>0)
-				layer->delta.x[j] = cost_activation_type*(layer->node.x[j]- target[j]);
+			// the forward pass already gave probabilities. targets are one-hot and
+			// delta is set wrt the softmax input so the softmax layer just passes it up
+			if (_softmax_cost == 2)
+				E = softmax::d_cross_entropy(layer->node.x, layer->delta.x, layer_node_size, label_index);
 			else
-				layer->delta.x[j] = _cost_function->d_cost(layer->node.x[j], target[j])*layer->df(layer->node.x, j, layer_node_size);
+			{
+				for (int j = 0; j < layer_node_size; j++)
+				{
+					const float target = (j == label_index) ? 1.f : 0.f;
+					layer->delta.x[j] = _cost_function->d_cost(layer->node.x[j], target);
+					E += mse::cost(layer->node.x[j], target);
+				}
+				softmax::df(layer->node.x, layer->delta.x, layer_node_size);
+			}
+			max_j_out = max_index(layer->node.x, layer_node_size);
+		}
+		else
+		{
+			// targets are all -1 except the label node which is 1
+			const float cost_activation_type = _cost_activation_type;
+			for (int j = 0; j < layer_node_size; j++)
+			{
+				const float target = (j == label_index) ? 1.f : -1.f;
+				if(cost_activation_type>0)
+					layer->delta.x[j] = cost_activation_type*(layer->node.x[j]- target);
+				else
+					layer->delta.x[j] = _cost_function->d_cost(layer->node.x[j], target)*layer->df(layer->node.x, j, layer_node_size);
 
-			if (layer->node.x[max_j_out] < layer->node.x[j]) max_j_out = j;
-			// for better E maybe just look at 2 highest scores so zeros don't dominate 
+				if (layer->node.x[max_j_out] < layer->node.x[j]) max_j_out = j;
+				// for better E maybe just look at 2 highest scores so zeros don't dominate 
 
-			E += mse::cost(layer->node.x[j], target[j]);
+				E += mse::cost(layer->node.x[j], target);
+			}
 		}
 	
 		E /= (float)layer_node_size;
 		// check for NAN
 		if (E != E) bail("network blew up - try lowering learning rate\n");
 		
-		// critical section in here, blocking update
 		bool match = false;
 		if ((max_j_target == max_j_out)) match = true;
-		update_smart_train(E, match);
+		update_smart_train(E, match, thread_number);
+		const bool skip = E>0 && E<_skip_energy_level && _smart_train && match;
+		if (record)
+		{
+			record->E = E;
+			record->epoch = (unsigned short)epoch_count;
+			record->correct = match;
+			record->skips = !skip ? 0 : (record->skips < _sample_cache_max_skip ? record->skips + 1 : record->skips);
+		}
 
-		if (E>0 && E<_skip_energy_level && _smart_train && match)
+		if (skip)
 		{
-			lock_batch();
-			batch_open[my_batch_index] = BATCH_FREE;
-			unlock_batch();
+			// give the slot back for another sample
+			if (!_hogwild)
+			{
+				// counted first, so whoever takes the slot counts it down after
+				_batch_skipped++;
+				batch_open[my_batch_index].store(BATCH_SKIPPED);
+			}
 			return false;  // return without doing training
 		}
 
@@ -897,17 +1998,23 @@ public:
 			{
 				base_layer *p_top=link.second;
 				// note all the delta[connections[i].second] should have been calculated by time we get here
-				layer->distribute_delta(*p_top, *W[link.first]);
+				if (Wbin[link.first]) layer->distribute_delta_binary(*p_top, *W[link.first], *Wbin[link.first]);
+				else layer->distribute_delta(*p_top, *W[link.first]);
 			}
 		}
 		
+		if (_hogwild)
+		{
+			hogwild_update(thread_number);
+			return true;
+		}
 
 		// update weights - shouldn't matter the direction we update these 
 		// we can stay in backwards direction...
 		// it was not faster to combine distribute_delta and increment_w into the same loop
-		int size_W=(int)W.size();
-		dW_sets[my_batch_index].resize(size_W);
-		dbias_sets[my_batch_index].resize(layer_cnt);
+		// into this thread's accumulators of the batch's bank, the slot only counts the sample for the batch
+		const int bank = my_batch % batch_banks();
+		const int my_set = bank*(int)layer_sets.size() + thread_number;
 		for(int k= last_layer_index; k>=0; k--)
 		{
 			layer = layer_sets[thread_number][k];
@@ -917,21 +2024,17 @@ public:
 				base_layer *p_top =link.second;
 				int w_index = (int)link.first;
 				//if (dynamic_cast<max_pooling_layer*> (layer) != NULL)  continue;
-				layer->calculate_dw(*p_top, dW_sets[my_batch_index][w_index]);// --- 20%
+				layer->calculate_dw(*p_top, dW_sets[my_set][w_index]);// --- 20%
 				// moved this out to sync_mini_batch();
 				//_optimizer->increment_w( W[w_index],w_index, dW_sets[_batch_index][w_index]);  // -- 10%
 			}
-			if( dynamic_cast<convolution_layer*> (layer) != NULL)  continue;
-	
-			dbias_sets[my_batch_index][k] = layer->delta;
+			if( dynamic_cast<convolution_layer*> (layer) == NULL) dbias_sets[my_set][k] += layer->delta;
+
+			// the last sample of the batch past this layer lets its update go while it carries on
+			if (++_layer_done[bank*layer_cnt + k] == _batch_size) publish_sync_chunks(bank, _layer_chunks_end[k]);
 		}
 		// if all batches finished, update weights
-		lock_batch();
-		batch_open[my_batch_index]=BATCH_COMPLETE;
-		int next_index=get_next_open_batch();
-		if(next_index==BATCH_FILLED_COMPLETE) // all complete
-			sync_mini_batch(); // resets _batch_index to 0
-		unlock_batch();
+		complete_batch(my_batch_index, my_batch);
 
 		return true;
 	}
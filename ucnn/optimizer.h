@@ -30,6 +30,7 @@
 #include <string>
 #include <vector>
 #include <cstdlib>
+#include <atomic>
 
 #include "core_math.h"
 
@@ -58,11 +59,19 @@ public:
 	optimizer(): learning_rate(0.01f) {}
 	virtual ~optimizer(){}
 	virtual void reset() {}
+	// forget the per weight state (network is being rebuilt, push_back will be called again)
+	virtual void clear() {}
 	// this increments the weight matrix w, which corresponds to connection index 'g'
 	// bottom is the number of grads coming up from the lower layer
 	// top is the current output node value of the upper layer
-	virtual void increment_w(matrix *w,  int g, const matrix &dW){}//, matrix *top){}
+	void increment_w(matrix *w,  int g, const matrix &dW) { increment_w(w, g, dW, 0, w->size()); }//, matrix *top){}
+	// same for elements [begin, end) only. ranges of one matrix do not depend on each other, so they can be
+	// stepped from different threads
+	virtual void increment_w(matrix *w,  int g, const matrix &dW, int begin, int end){}
 	virtual void push_back(int w, int h, int c){}	
+	// precision the per weight state is kept in, PRECISION_FP32 or PRECISION_BF16. false if not supported
+	virtual bool set_state_precision(int p) { return p == PRECISION_FP32 || p == PRECISION_BF16; }
+	virtual int get_state_precision() { return PRECISION_FP32; }
 };
 
 #ifndef NO_TRAINING_CODE
@@ -73,106 +82,238 @@ class sgd: public optimizer
 public:
 	static const char *name(){return "sgd";}
 
-	virtual void increment_w(matrix *w,  int g, const matrix &dW)
+	virtual void increment_w(matrix *w,  int g, const matrix &dW, int begin, int end)
 	{
 		const float w_decay=0.01f;//1;
-		for(int s=0; s<w->size(); s++)	
+		int s=begin;
+#ifdef UCNN_SSE3
+		const __m128 decay=_mm_set1_ps(w_decay), lr=_mm_set1_ps(learning_rate);
+		for(; s+4<=end; s+=4)
+		{
+			const __m128 x=_mm_loadu_ps(w->x+s);
+			_mm_storeu_ps(w->x+s, _mm_sub_ps(x, _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(dW.x+s), _mm_mul_ps(decay, x)), lr)));
+		}
+#endif
+		for(; s<end; s++)	
 			w->x[s] -= (dW.x[s] + w_decay*w->x[s])*learning_rate;
 	}
 };
 
-class adagrad: public optimizer
+// moments are read and written through these, as float or bf16. bf16 stores round stochastically, so the 0.1%
+// steps of a slow moving average still add up instead of rounding away. the random draw r of element s is
+// seed + s*MOMENT_NOISE_STEP (moment_noise) with a hashed seed per call, so each element's draws are uniform
+// from step to step. it does not depend on the gradient, which would give no noise when it is 0 or has few
+// mantissa bits, and it is one add per 4 elements in the sse path, which draws the same
+const unsigned int MOMENT_NOISE_STEP = 0x9e3779b9u;
+inline float load_moment(const float *p) { return *p; }
+inline float load_moment(const unsigned short *p) { return bf16_to_float(*p); }
+inline void store_moment(float *p, const float v, const unsigned int r) { *p = v; }
+inline void store_moment(unsigned short *p, const float v, const unsigned int r) { *p = float_to_bf16_stochastic(v, r); }
+inline unsigned int moment_noise(const unsigned int seed, const int s) { return seed + (unsigned int)s*MOMENT_NOISE_STEP; }
+#ifdef UCNN_SSE3
+inline __m128 load_moment4(const float *p) { return _mm_loadu_ps(p); }
+inline __m128 load_moment4(const unsigned short *p) { return _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64((const __m128i *)p))); }
+inline void store_moment4(float *p, const __m128 v, const __m128i r) { _mm_storeu_ps(p, v); }
+inline void store_moment4(unsigned short *p, const __m128 v, const __m128i r) { _mm_storel_epi64((__m128i *)p, float_to_bf16_stochastic_sse(v, r)); }
+// moment_noise of s..s+3, stepped by moment_next4 to the next 4 elements
+inline __m128i moment_noise4(const unsigned int seed, const int s)
 {
-	// persistent variables that mirror size of weight matrix
-	std::vector<matrix *> G1;
+	const unsigned int k = MOMENT_NOISE_STEP;
+	return _mm_add_epi32(_mm_set1_epi32((int)(seed + (unsigned int)s*k)), _mm_setr_epi32(0, (int)k, (int)(2*k), (int)(3*k)));
+}
+inline __m128i moment_next4(const __m128i i) { return _mm_add_epi32(i, _mm_set1_epi32((int)(4*MOMENT_NOISE_STEP))); }
+#endif
+
+// optimizers keeping moments the size of each weight matrix. they are laid out in one block, all of moment 0
+// then all of moment 1, as floats or (set_state_precision) bf16
+class moment_optimizer: public optimizer
+{
+	const int _moments;
+	int _precision;
+	std::vector<int> _sizes;      // per connection
+	std::vector<size_t> _offsets; // per connection, into each moment
+	size_t _stride;               // floats of one moment
+	float_arena _state;
+	std::vector<unsigned short> _state16;
+	std::atomic<unsigned int> _draws; // calls that rounded stochastically, for their seeds
+
+	float get(size_t i) { return _precision == PRECISION_BF16 ? bf16_to_float(_state16[i]) : _state.data()[i]; }
+
+	// lays the moments out for _sizes in precision p, keeping the values
+	void layout(int p)
+	{
+		std::vector<size_t> offsets;
+		size_t stride = 0;
+		__for__(auto n __in__ _sizes) { offsets.push_back(stride); stride += float_arena::padded(n); }
+		std::vector<float> v(stride*_moments, 0.f);
+		for (int m = 0; m < _moments; m++)
+			for (size_t g = 0; g < _offsets.size(); g++)
+				for (int i = 0; i < _sizes[g]; i++) v[m*stride + offsets[g] + i] = get(m*_stride + _offsets[g] + i);
+		_state.clear(); _state16.clear();
+		if (p == PRECISION_BF16)
+		{
+			_state16.resize(v.size());
+			for (size_t i = 0; i < v.size(); i++) _state16[i] = float_to_bf16(v[i]);
+		}
+		else
+		{
+			_state.allocate(v.size());
+			if (v.size()) memcpy(_state.data(), &v[0], sizeof(float)*v.size());
+		}
+		_offsets = offsets; _stride = stride; _precision = p;
+	}
+
+protected:
+	bool bf16() const { return _precision == PRECISION_BF16; }
+	// moment m of connection g
+	float *moment(int g, int m) { return _state.data() + m*_stride + _offsets[g]; }
+	unsigned short *moment16(int g, int m) { return &_state16[m*_stride + _offsets[g]]; }
+	// seed for the draws of one bf16 call. chunks of one step may run on different threads, so it is atomic
+	unsigned int draw_seed()
+	{
+		unsigned int x = (_draws.fetch_add(1) + 1)*0x85ebca6bu;
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		return x;
+	}
+
 public:
-	static const char *name(){return "adagrad";}
+	moment_optimizer(int moments): _moments(moments), _precision(PRECISION_FP32), _stride(0), _draws(0) {}
 
-	virtual ~adagrad(){__for__(auto g __in__ G1) delete g;}
-	virtual void push_back(int w, int h, int c) {
-		G1.push_back(new matrix(w, h, c));
-	}// G1[G1.size() - 1]->fill(0);
+	virtual void push_back(int w, int h, int c) { _sizes.push_back(w*h*c); layout(_precision); }
+	virtual void reset() { _state.fill(0.f); _state16.assign(_state16.size(), 0); }
+	virtual void clear() { _sizes.clear(); _offsets.clear(); _stride = 0; _state.clear(); _state16.clear(); }
+	virtual bool set_state_precision(int p)
+	{
+		if (p != PRECISION_FP32 && p != PRECISION_BF16) return false;
+		if (p != _precision) layout(p);
+		return true;
+	}
+	virtual int get_state_precision() { return _precision; }
+};
 
-	
-	virtual void reset() { __for__(auto g __in__ G1) g->fill(0.f);}
-	virtual void increment_w(matrix *w,  int g, const matrix &dW)
+class adagrad: public moment_optimizer
+{
+	template<class S> void step(float *w, S *g1, const float *dw, int begin, int end, unsigned int seed)
 	{
-		float *g1 = G1[g]->x;
-		//float min, max;
-		//G1[g]->min_max(&min, &max);
-		//std::cout << "((" << min << "," << max << ")";
 		const float eps = 1.e-8f;
-		// if (G1[g]->size() != w->size()) throw;
-		for(int s=0; s<w->size(); s++) 
+		int s=begin;
+#ifdef UCNN_SSE3
+		// sqrt and div rather than rsqrt: exact like the scalar loop and still hidden behind the memory traffic
+		const __m128 lr=_mm_set1_ps(learning_rate), e=_mm_set1_ps(eps);
+		__m128i r=moment_noise4(seed, s);
+		for(; s+4<=end; s+=4, r=moment_next4(r))
 		{
-			g1[s] += dW.x[s] * dW.x[s];
-			//if (g1[s] < 1) throw;
-			w->x[s] -= learning_rate*dW.x[s]/(std::sqrt(g1[s]) + eps);
+			const __m128 d=_mm_loadu_ps(dw+s);
+			const __m128 v=_mm_add_ps(load_moment4(g1+s), _mm_mul_ps(d, d));
+			store_moment4(g1+s, v, r);
+			_mm_storeu_ps(w+s, _mm_sub_ps(_mm_loadu_ps(w+s), _mm_div_ps(_mm_mul_ps(lr, d), _mm_add_ps(_mm_sqrt_ps(v), e))));
+		}
+#endif
+		for(; s<end; s++) 
+		{
+			const float v = load_moment(g1+s) + dw[s] * dw[s];
+			store_moment(g1+s, v, moment_noise(seed, s));
+			w[s] -= learning_rate*dw[s]/(std::sqrt(v) + eps);
 		}	
+	}
+public:
+	static const char *name(){return "adagrad";}
+	adagrad(): moment_optimizer(1) {}
+
+	virtual void increment_w(matrix *w,  int g, const matrix &dW, int begin, int end)
+	{
+		if (bf16()) step(w->x, moment16(g, 0), dW.x, begin, end, draw_seed());
+		else step(w->x, moment(g, 0), dW.x, begin, end, 0);
 	};
 };
 
-class rmsprop: public optimizer
+class rmsprop: public moment_optimizer
 {
-	// persistent variables that mirror size of weight matrix
-	std::vector<matrix *> G1;
-public:
-	static const char *name(){return "rmsprop";}
-	virtual ~rmsprop(){__for__(auto g __in__ G1) delete g;}
-
-	virtual void push_back(int w, int h, int c){ G1.push_back(new matrix(w,h,c)); G1[G1.size() - 1]->fill(0);}
-	virtual void reset() { __for__(auto g __in__ G1) g->fill(0.f);}
-	virtual void increment_w(matrix *w,  int g, const matrix &dW)
+	template<class S> void step(float *w, S *g1, const float *dw, int begin, int end, unsigned int seed)
 	{
-		float *g1 = G1[g]->x;
 		const float eps = 1.e-8f;
 		const float mu = 0.999f;
-		for(int s=0; s<(int)w->size(); s++)
+		int s=begin;
+#ifdef UCNN_SSE3
+		const __m128 m=_mm_set1_ps(mu), m1=_mm_set1_ps(1-mu), lr=_mm_set1_ps(0.01f*learning_rate), e=_mm_set1_ps(eps);
+		__m128i r=moment_noise4(seed, s);
+		for(; s+4<=end; s+=4, r=moment_next4(r))
 		{
-			g1[s] = mu * g1[s]+(1-mu) * dW.x[s] * dW.x[s];
-			w->x[s] -= 0.01f*learning_rate*dW.x[s]/(std::sqrt(g1[s]) + eps);
+			const __m128 d=_mm_loadu_ps(dw+s);
+			const __m128 v=_mm_add_ps(_mm_mul_ps(m, load_moment4(g1+s)), _mm_mul_ps(_mm_mul_ps(m1, d), d));
+			store_moment4(g1+s, v, r);
+			_mm_storeu_ps(w+s, _mm_sub_ps(_mm_loadu_ps(w+s), _mm_div_ps(_mm_mul_ps(lr, d), _mm_add_ps(_mm_sqrt_ps(v), e))));
+		}
+#endif
+		for(; s<end; s++)
+		{
+			const float v = mu * load_moment(g1+s)+(1-mu) * dw[s] * dw[s];
+			store_moment(g1+s, v, moment_noise(seed, s));
+			w[s] -= 0.01f*learning_rate*dw[s]/(std::sqrt(v) + eps);
 		}	
+	}
+public:
+	static const char *name(){return "rmsprop";}
+	rmsprop(): moment_optimizer(1) {}
+
+	virtual void increment_w(matrix *w,  int g, const matrix &dW, int begin, int end)
+	{
+		if (bf16()) step(w->x, moment16(g, 0), dW.x, begin, end, draw_seed());
+		else step(w->x, moment(g, 0), dW.x, begin, end, 0);
 	};
 
 };
 
-class adam: public optimizer
+class adam: public moment_optimizer
 {
 	float b1_t, b2_t;
 	const float b1, b2;
-	// persistent variables that mirror size of weight matrix
-	std::vector<matrix *> G1;
-	std::vector<matrix *> G2;
+
+	template<class S> void step(float *w, S *g1, S *g2, const float *dw, int begin, int end, unsigned int seed)
+	{
+		const float eps = 1.e-8f;
+		const float b1=0.9f, b2=0.999f;
+		// bias corrections folded into two per call scales, all float
+		const float c1 = 0.1f*learning_rate/(1.f-b1_t), c2 = (float)(1./(1.-b2_t));
+		int s=begin;
+#ifdef UCNN_SSE3
+		const __m128 vb1=_mm_set1_ps(b1), vb1m=_mm_set1_ps(1-b1), vb2=_mm_set1_ps(b2), vb2m=_mm_set1_ps(1-b2);
+		const __m128 vc1=_mm_set1_ps(c1), vc2=_mm_set1_ps(c2), e=_mm_set1_ps(eps);
+		__m128i r=moment_noise4(seed, s);
+		for(; s+4<=end; s+=4, r=moment_next4(r))
+		{
+			const __m128 d=_mm_loadu_ps(dw+s);
+			const __m128 m=_mm_add_ps(_mm_mul_ps(vb1, load_moment4(g1+s)), _mm_mul_ps(vb1m, d));
+			const __m128 v=_mm_add_ps(_mm_mul_ps(vb2, load_moment4(g2+s)), _mm_mul_ps(_mm_mul_ps(vb2m, d), d));
+			store_moment4(g1+s, m, r);
+			store_moment4(g2+s, v, _mm_srli_epi32(r, 16));
+			_mm_storeu_ps(w+s, _mm_sub_ps(_mm_loadu_ps(w+s), _mm_div_ps(_mm_mul_ps(vc1, m), _mm_add_ps(_mm_sqrt_ps(_mm_mul_ps(vc2, v)), e))));
+		}
+#endif
+		for(; s<end; s++)
+			{
+				const float m = b1* load_moment(g1+s)+(1-b1) * dw[s];
+				const float v = b2* load_moment(g2+s)+(1-b2) * dw[s]*dw[s];
+				const unsigned int r = moment_noise(seed, s);
+				store_moment(g1+s, m, r);
+				store_moment(g2+s, v, r >> 16);
+				w[s] -= c1*m / (std::sqrt(c2*v) + eps);
+			}	
+	}
 public:
 	static const char *name(){return "adam";}
-	adam(): b1(0.9f), b1_t(0.9f), b2(0.999f), b2_t(0.999f), optimizer()	{}
-	virtual ~adam(){__for__(auto g __in__ G1) delete g; __for__(auto g __in__ G2) delete g;}
+	adam(): moment_optimizer(2), b1_t(0.9f), b2_t(0.999f), b1(0.9f), b2(0.999f)	{}
 
 	virtual void reset()
 	{
 		b1_t*=b1; b2_t*=b2;
-		__for__(auto g __in__ G1) g->fill(0.f);
-		__for__(auto g __in__ G2) g->fill(0.f);
+		moment_optimizer::reset();
 	}
 
-	virtual void push_back(int w, int h, int c)
+	virtual void increment_w(matrix *w,  int g, const matrix &dW, int begin, int end)
 	{
-		G1.push_back(new matrix(w,h,c)); G1[G1.size() - 1]->fill(0); 
-		G2.push_back(new matrix(w,h,c)); G2[G2.size() - 1]->fill(0);
-	}
-
-	virtual void increment_w(matrix *w,  int g, const matrix &dW)
-	{
-		float *g1 = G1[g]->x;
-		float *g2 = G2[g]->x;
-		const float eps = 1.e-8f;
-		const float b1=0.9f, b2=0.999f;
-		for(int s=0; s<(int)w->size(); s++)
-			{
-				g1[s] = b1* g1[s]+(1-b1) * dW.x[s];
-				g2[s] = b2* g2[s]+(1-b2) * dW.x[s]*dW.x[s];
-				w->x[s] -= 0.1f*learning_rate* (g1[s]/(1.f-b1_t)) / ((float)std::sqrt(g2[s]/(1.-b2_t)) + eps);
-			}	
+		if (bf16()) step(w->x, moment16(g, 0), moment16(g, 1), dW.x, begin, end, draw_seed());
+		else step(w->x, moment(g, 0), moment(g, 1), dW.x, begin, end, 0);
 	};
 
 };
@@ -0,0 +1,376 @@
+// == ucnn ====================================================================
+//
+//    Copyright (c) gnawice@gnawice.com. All rights reserved.
+//	  See LICENSE in root folder
+//
+//    This file is part of ucnn.
+//
+//    uncc is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as published
+//    by the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    ucnn is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with ucnn.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+//    plan.h: flat forward pass kernels, the execution plan made by network::compile()
+//
+// ==================================================================== ucnn ==
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "layer.h"
+#include "thread_pool.h"
+
+namespace ucnn {
+
+// one kernel invocation of a compiled forward pass. everything is resolved when the plan is built:
+// buffers, weights and shapes, and the kernel itself is picked for the layer type, kernel size and activation.
+// a kernel does units [begin, end) of the step's work (output maps, rows or channels), so a step can be split
+// over threads (parts > 1). part picks the scratch when there is some
+struct plan_step
+{
+	void (*run)(const plan_step &s, int begin, int end, int part);
+	const float *in;       // top layer nodes
+	float *out;            // bottom layer nodes
+	const float *w;        // float weights. convolution: filter bank, filter_step floats per (map, input chan)
+	const float *bias;
+	const void *packed;    // half_matrix, block_sparse_matrix, binary_matrix or the matrix for layer calls
+	base_layer *top, *layer;
+	float *scratch;        // scratch_step floats per part
+	unsigned char *map;    // max pool positions
+	int in_cols, in_rows, in_chans;
+	int out_cols, out_rows, out_chans;
+	int kernel_cols, kernel_rows, stride, filter_step;
+	int units, parts, scratch_step;
+	float work;            // multiply-adds (or so) of the whole step, to pick parts
+};
+
+typedef void (*plan_function)(const plan_step &s, int begin, int end, int part);
+typedef float (*plan_activation)(float *, int, const int, const float);
+
+//----------------------------------------------------------------------------------------------------------
+// activations, the function is a template argument so it gets inlined
+
+// a bias per node (fully connected). units are nodes
+template<plan_activation F> void step_activate_nodes(const plan_step &s, int begin, int end, int part)
+{
+	const int size = s.out_cols*s.out_rows*s.out_chans;
+	for (int i = begin; i < end; i++) s.out[i] = F(s.out, i, size, s.bias[i]);
+}
+
+// a bias per map (convolution, or the max pool fused with it). units are maps
+template<plan_activation F> void step_activate_maps(const plan_step &s, int begin, int end, int part)
+{
+	const int map_size = s.out_cols*s.out_rows;
+	for (int c = begin; c < end; c++)
+	{
+		const float b = s.bias[c];
+		float *x = s.out + c*map_size;
+		for (int i = 0; i < map_size; i++) x[i] = F(x, i, map_size, b);
+	}
+}
+
+inline plan_function activation_step(const std::string &name, const bool per_map)
+{
+	if (name == tan_h::name) return per_map ? &step_activate_maps<&tan_h::f> : &step_activate_nodes<&tan_h::f>;
+	if (name == elu::name) return per_map ? &step_activate_maps<&elu::f> : &step_activate_nodes<&elu::f>;
+	if (name == identity::name) return per_map ? &step_activate_maps<&identity::f> : &step_activate_nodes<&identity::f>;
+	if (name == relu::name) return per_map ? &step_activate_maps<&relu::f> : &step_activate_nodes<&relu::f>;
+	if (name == lrelu::name) return per_map ? &step_activate_maps<&lrelu::f> : &step_activate_nodes<&lrelu::f>;
+	if (name == vlrelu::name) return per_map ? &step_activate_maps<&vlrelu::f> : &step_activate_nodes<&vlrelu::f>;
+	if (name == sigmoid::name) return per_map ? &step_activate_maps<&sigmoid::f> : &step_activate_nodes<&sigmoid::f>;
+	if (name == none::name) return per_map ? &step_activate_maps<&none::f> : &step_activate_nodes<&none::f>;
+	return NULL;
+}
+
+//----------------------------------------------------------------------------------------------------------
+// fully connected: out += in . w (w rows are outputs). units are outputs, or blocks of 4 when sparse
+
+inline void step_fully_connected(const plan_step &s, int begin, int end, int part)
+{
+	const int cols = s.in_cols;
+	for (int j = begin; j < end; j++) s.out[j] += dot(s.in, s.w + j*cols, cols);
+}
+inline void step_fully_connected_half(const plan_step &s, int begin, int end, int part)
+{
+	((const half_matrix *)s.packed)->dot_1dx2d_add(s.in, s.out, begin, end);
+}
+inline void step_fully_connected_sparse(const plan_step &s, int begin, int end, int part)
+{
+	((const block_sparse_matrix *)s.packed)->dot_1dx2d_add(s.in, s.out, begin, end);
+}
+
+//----------------------------------------------------------------------------------------------------------
+// convolution, stride 1 and square like convolution_layer. units are output maps
+
+// floats per filter in a plan's filter bank: the unwrapped window for the SSE 3x3 and 5x5 kernels, else the kernel
+inline int plan_filter_step(const int kernel_cols, const int kernel_rows)
+{
+#ifdef UCNN_SSE3
+	if (kernel_cols == 3 && kernel_rows == 3) return 12;
+	if (kernel_cols == 5 && kernel_rows == 5) return 28;
+#endif
+	return kernel_cols*kernel_rows;
+}
+
+#ifdef UCNN_SSE3
+// each output pixel's window is unwrapped once per input chan into scratch (padded to filter_step floats),
+// then dotted with the filters of every map. the filter bank is padded the same way and 16 byte aligned
+template<int K> void step_convolution_unwrapped(const plan_step &s, int begin, int end, int part)
+{
+	const int in_plane = s.in_cols*s.in_rows;
+	const int outsize = s.out_cols*s.out_rows;
+	float *img = s.scratch + part*s.scratch_step;
+	float *tmp = img + outsize*s.filter_step;
+	for (int k = 0; k < s.in_chans; k++)
+	{
+		if (K == 5) unwrap_aligned_5x5(img, s.in + k*in_plane, s.in_cols);
+		else unwrap_aligned_3x3(img, s.in + k*in_plane, s.in_cols);
+		for (int map = begin; map < end; map++)
+		{
+			const float *f = s.w + (map + k*s.out_chans)*s.filter_step;
+			if (K == 5) dot_unwrapped_5x5_sse(img, f, tmp, outsize);
+			else dot_unwrapped_3x3_sse(img, f, tmp, outsize);
+			float *out = s.out + map*outsize;
+			for (int j = 0; j < outsize; j++) out[j] += tmp[j];
+		}
+	}
+}
+#endif
+
+template<int K> void step_convolution_k(const plan_step &s, int begin, int end, int part)
+{
+	const int in_plane = s.in_cols*s.in_rows;
+	const int jstep = s.in_cols;
+	const int map_size = s.out_cols*s.out_rows;
+	for (int k = 0; k < s.in_chans; k++)
+	{
+		const float *in = s.in + k*in_plane;
+		for (int map = begin; map < end; map++)
+		{
+			const float *f = s.w + (map + k*s.out_chans)*s.filter_step;
+			float *out = s.out + map*map_size;
+			for (int j = 0; j < s.out_rows; j++)
+				for (int i = 0; i < s.out_cols; i++)
+				{
+					if (K == 5) out[i + j*s.out_cols] += unwrap_2d_dot_5x5(in + i + j*jstep, f, jstep, K);
+					else out[i + j*s.out_cols] += unwrap_2d_dot_3x3(in + i + j*jstep, f, jstep, K);
+				}
+		}
+	}
+}
+
+inline void step_convolution(const plan_step &s, int begin, int end, int part)
+{
+	const int in_plane = s.in_cols*s.in_rows;
+	const int jstep = s.in_cols;
+	const int map_size = s.out_cols*s.out_rows;
+	for (int k = 0; k < s.in_chans; k++)
+		for (int map = begin; map < end; map++)
+		{
+			const float *f = s.w + (map + k*s.out_chans)*s.filter_step;
+			float *out = s.out + map*map_size;
+			for (int j = 0; j < s.out_rows; j++)
+				for (int i = 0; i < s.out_cols; i++)
+					out[i + j*s.out_cols] += unwrap_2d_dot(s.in + i + j*jstep + k*in_plane, f, s.kernel_cols, jstep, s.kernel_cols);
+		}
+}
+
+// binary layers run their own kernels (whole, one unit). the calls are qualified so they are not virtual
+inline void step_binary_convolution(const plan_step &s, int begin, int end, int part)
+{
+	((binary_convolution_layer *)s.layer)->binary_convolution_layer::accumulate_signal_binary(*s.top, *(const binary_matrix *)s.packed);
+}
+inline void step_binary_fully_connected(const plan_step &s, int begin, int end, int part)
+{
+	((binary_fully_connected_layer *)s.layer)->binary_fully_connected_layer::accumulate_signal_binary(*s.top, *(const binary_matrix *)s.packed);
+}
+
+//----------------------------------------------------------------------------------------------------------
+// no weights. pools split over channels, the rest is one unit
+
+template<int PX, int PY, int S> void step_max_pool(const plan_step &s, int begin, int end, int part)
+{
+	const int kstep = s.in_cols*s.in_rows;
+	const int jstep = s.in_cols;
+	const int map_size = s.out_cols*s.out_rows;
+	for (int k = begin; k < end; k++)
+		for (int j = 0; j < s.out_rows; j++)
+		{
+			const int o = j*s.out_cols + k*map_size;
+			max_pool_row(s.in + j*S*jstep + k*kstep, jstep, s.out + o, s.map + o, s.out_cols, PX, PY, S);
+		}
+}
+
+inline void step_max_pool_any(const plan_step &s, int begin, int end, int part)
+{
+	const int kstep = s.in_cols*s.in_rows;
+	const int jstep = s.in_cols;
+	const int map_size = s.out_cols*s.out_rows;
+	for (int k = begin; k < end; k++)
+		for (int j = 0; j < s.out_rows; j++)
+		{
+			const int o = j*s.out_cols + k*map_size;
+			max_pool_row(s.in + j*s.stride*jstep + k*kstep, jstep, s.out + o, s.map + o, s.out_cols, s.kernel_cols, s.kernel_rows, s.stride);
+		}
+}
+
+inline void step_softmax(const plan_step &s, int begin, int end, int part) { softmax::f(s.in, s.out, s.in_cols*s.in_rows*s.in_chans); }
+inline void step_copy(const plan_step &s, int begin, int end, int part) { memcpy(s.out, s.in, sizeof(float)*s.in_cols*s.in_rows*s.in_chans); }
+inline void step_zero(const plan_step &s, int begin, int end, int part) { memset(s.out, 0, sizeof(float)*s.out_cols*s.out_rows*s.out_chans); }
+
+// anything else goes through the layer (virtual)
+inline void step_layer(const plan_step &s, int begin, int end, int part) { s.layer->accumulate_signal(*s.top, *(const matrix *)s.packed, 0); }
+inline void step_layer_activate(const plan_step &s, int begin, int end, int part) { s.layer->activate_nodes(); }
+
+//----------------------------------------------------------------------------------------------------------
+// a compiled forward pass for one layer set. built by network::compile()
+class forward_plan
+{
+	std::vector<std::vector<float>> _floats;
+	std::vector<std::vector<unsigned char>> _bytes;
+public:
+	std::vector<plan_step> steps;
+	thread_pool *pool; // splits steps when set, see split()
+	float *input;
+	int input_size;
+	float *output;
+	size_t node_bytes;  // activations left in the layer nodes' own memory, all live at once
+	size_t arena_bytes; // activations moved to the shared arena by share_activations()
+
+	forward_plan() : pool(NULL), input(NULL), input_size(0), output(NULL), node_bytes(0), arena_bytes(0) {}
+
+	// activation memory allocated for a pass: the shared arena plus the nodes left in the layers
+	size_t activation_bytes() const { return node_bytes + arena_bytes; }
+
+	// 16 byte aligned, zeroed buffers owned by the plan
+	float *alloc(const int size)
+	{
+		_floats.push_back(std::vector<float>(size + 4, 0.f));
+		return (float *)(((uintptr_t)_floats.back().data() + 15) & ~(uintptr_t)0x0F);
+	}
+	unsigned char *alloc_bytes(const int size)
+	{
+		_bytes.push_back(std::vector<unsigned char>(size, 0));
+		return _bytes.back().data();
+	}
+
+	plan_step &add(plan_function f)
+	{
+		plan_step s;
+		memset(&s, 0, sizeof(s));
+		s.run = f;
+		s.units = 1;
+		steps.push_back(s);
+		return steps.back();
+	}
+
+	// parts a step is split in: no more than the pool's threads or the step's units, and each part gets at least
+	// min_work, so small layers run whole instead of paying for the hand off
+	int split(plan_step &s, const float min_work = 32768.f)
+	{
+		int parts = pool ? pool->size() : 1;
+		if (parts > s.units) parts = s.units;
+		const float most = s.work / min_work;
+		if (parts > most) parts = (int)most;
+		s.parts = parts < 1 ? 1 : parts;
+		return s.parts;
+	}
+
+	// liveness based memory planning. a node is live from the step that first writes it to the step that
+	// last reads it (the input from the start, the output to the end). nodes are placed, largest first, at the
+	// lowest arena offset not used by a node whose lifetime overlaps, then every step is pointed at the arena.
+	// a moved node's own memory is freed and it is left as a view of its place in the arena, which is only
+	// valid while the plan is (see network::drop_plans). pinned nodes are accessed through their layer
+	// (virtual fallbacks) and stay where they are
+	void share_activations(const std::vector<matrix *> &nodes, const std::vector<float *> &pinned)
+	{
+		const int n = (int)nodes.size();
+		std::vector<int> first(n, -1), last(n, -1), offset(n, -1), order;
+		for (int b = 0; b < n; b++)
+		{
+			const float *x = nodes[b]->x;
+			if (std::find(pinned.begin(), pinned.end(), x) != pinned.end()) continue;
+			if (x == input) first[b] = 0;
+			for (int i = 0; i < (int)steps.size(); i++)
+			{
+				if (steps[i].in != x && steps[i].out != x) continue;
+				if (first[b] < 0) first[b] = i;
+				last[b] = i;
+			}
+			if (x == output) last[b] = (int)steps.size();
+			if (first[b] >= 0) order.push_back(b);
+		}
+		for (int i = 0; i < (int)order.size(); i++)
+			for (int j = i + 1; j < (int)order.size(); j++)
+				if (nodes[order[j]]->size() > nodes[order[i]]->size()) std::swap(order[i], order[j]);
+
+		int arena_size = 0;
+		for (int i = 0; i < (int)order.size(); i++)
+		{
+			const int b = order[i];
+			const int size = (nodes[b]->size() + 3) & ~3; // keep every node 16 byte aligned
+			int at = 0;
+			for (bool moved = true; moved;)
+			{
+				moved = false;
+				for (int j = 0; j < i; j++)
+				{
+					const int o = order[j];
+					if (last[o] < first[b] || last[b] < first[o]) continue; // not live at the same time
+					const int o_size = (nodes[o]->size() + 3) & ~3;
+					if (at < offset[o] + o_size && offset[o] < at + size) { at = offset[o] + o_size; moved = true; }
+				}
+			}
+			offset[b] = at;
+			if (at + size > arena_size) arena_size = at + size;
+		}
+		size_t moved = 0;
+		for (int i = 0; i < (int)order.size(); i++) moved += nodes[order[i]]->size();
+		if (order.empty() || (size_t)arena_size >= moved) return; // nothing saved
+
+		float *arena = alloc(arena_size);
+		for (int i = 0; i < (int)order.size(); i++)
+		{
+			const int b = order[i];
+			float *from = nodes[b]->x, *to = arena + offset[b];
+			for (int k = 0; k < (int)steps.size(); k++)
+			{
+				if (steps[k].in == from) steps[k].in = to;
+				if (steps[k].out == from) steps[k].out = to;
+			}
+			if (input == from) input = to;
+			if (output == from) output = to;
+			node_bytes -= sizeof(float)*nodes[b]->size();
+			nodes[b]->view(to);
+		}
+		arena_bytes = sizeof(float)*arena_size;
+	}
+
+	float *run(const float *in)
+	{
+		memcpy(input, in, sizeof(float)*input_size);
+		const plan_step *s = steps.data();
+		const int n = (int)steps.size();
+		for (int i = 0; i < n; i++)
+		{
+			if (s[i].parts <= 1) { s[i].run(s[i], 0, s[i].units, 0); continue; }
+			const plan_step &step = s[i];
+			auto part = [&step](int p, int thread) { step.run(step, step.units*p / step.parts, step.units*(p + 1) / step.parts, p); };
+			pool->parallel_for(step.parts, part);
+		}
+		return output;
+	}
+};
+
+} // namespace
@@ -0,0 +1,529 @@
+// == ucnn ====================================================================
+//
+//    Copyright (c) gnawice@gnawice.com. All rights reserved.
+//	  See LICENSE in root folder
+//
+//    This file is part of ucnn.
+//
+//    uncc is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as published
+//    by the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    ucnn is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with ucnn.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+//    quantize.h: int8 inference for a trained network
+//
+// ==================================================================== ucnn ==
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#if defined(__AVX2__) || defined(__AVXVNNI__) || defined(__AVX512VNNI__)
+#include <immintrin.h>
+#endif
+
+#include "network.h"
+
+namespace ucnn {
+
+// int8 vectors are zero padded to this many bytes so the kernels never need a tail
+const int INT8_ALIGN = 32;
+inline int int8_padded(const int size) { return (size + INT8_ALIGN - 1) / INT8_ALIGN*INT8_ALIGN; }
+
+// int8 x int8 -> int32 dot product. size must be a multiple of INT8_ALIGN
+// VNNI: u8*s8 with dpbusd, activations are offset by 128 and the offset is taken back out with a second dpbusd
+// AVX2/SSE: both sides widened to int16 and summed with madd_epi16. (maddubs would saturate int16 on full range u8*s8 pairs)
+inline int dot_i8(const signed char *a, const signed char *w, const int size)
+{
+#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__))
+	const __m256i offset = _mm256_set1_epi8((char)0x80);
+	__m256i acc = _mm256_setzero_si256();
+	__m256i corr = _mm256_setzero_si256();
+	for (int i = 0; i < size; i += 32)
+	{
+		const __m256i va = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)), offset);
+		const __m256i vw = _mm256_loadu_si256((const __m256i*)(w + i));
+	#if defined(__AVXVNNI__)
+		acc = _mm256_dpbusd_avx_epi32(acc, va, vw);
+		corr = _mm256_dpbusd_avx_epi32(corr, offset, vw);
+	#else
+		acc = _mm256_dpbusd_epi32(acc, va, vw);
+		corr = _mm256_dpbusd_epi32(corr, offset, vw);
+	#endif
+	}
+	acc = _mm256_sub_epi32(acc, corr);
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	s = _mm_hadd_epi32(s, s); s = _mm_hadd_epi32(s, s);
+	return _mm_cvtsi128_si32(s);
+#elif defined(__AVX2__)
+	__m256i acc = _mm256_setzero_si256();
+	for (int i = 0; i < size; i += 32)
+	{
+		const __m128i *pa = (const __m128i*)(a + i);
+		const __m128i *pw = (const __m128i*)(w + i);
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128(pa)), _mm256_cvtepi8_epi16(_mm_loadu_si128(pw))));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128(pa + 1)), _mm256_cvtepi8_epi16(_mm_loadu_si128(pw + 1))));
+	}
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	s = _mm_hadd_epi32(s, s); s = _mm_hadd_epi32(s, s);
+	return _mm_cvtsi128_si32(s);
+#elif defined(UCNN_SSE3)
+	__m128i acc = _mm_setzero_si128();
+	for (int i = 0; i < size; i += 16)
+	{
+		const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		const __m128i vw = _mm_loadu_si128((const __m128i*)(w + i));
+		// sign extend to int16 by unpacking into the high byte and shifting back down
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_srai_epi16(_mm_unpacklo_epi8(va, va), 8), _mm_srai_epi16(_mm_unpacklo_epi8(vw, vw), 8)));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_srai_epi16(_mm_unpackhi_epi8(va, va), 8), _mm_srai_epi16(_mm_unpackhi_epi8(vw, vw), 8)));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(acc);
+#else
+	int v = 0;
+	for (int i = 0; i < size; i++) v += (int)a[i] * (int)w[i];
+	return v;
+#endif
+}
+
+// 4 rows at once: out[r] = dot(a, w + r*row_size). the activation loads are shared and the 4 sums are
+// reduced together. wsum[r] is 128*sum(w row r), only used by VNNI to remove the u8 offset
+inline void dot_i8_x4(const signed char *a, const signed char *w, const int row_size, const int *wsum, int *out)
+{
+#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVX2__)
+	__m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256(), acc2 = _mm256_setzero_si256(), acc3 = _mm256_setzero_si256();
+	#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__))
+		#if defined(__AVXVNNI__)
+			#define UCNN_DPBUSD _mm256_dpbusd_avx_epi32
+		#else
+			#define UCNN_DPBUSD _mm256_dpbusd_epi32
+		#endif
+	const __m256i offset = _mm256_set1_epi8((char)0x80);
+	for (int i = 0; i < row_size; i += 32)
+	{
+		const __m256i va = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)), offset);
+		acc0 = UCNN_DPBUSD(acc0, va, _mm256_loadu_si256((const __m256i*)(w + i)));
+		acc1 = UCNN_DPBUSD(acc1, va, _mm256_loadu_si256((const __m256i*)(w + row_size + i)));
+		acc2 = UCNN_DPBUSD(acc2, va, _mm256_loadu_si256((const __m256i*)(w + 2 * row_size + i)));
+		acc3 = UCNN_DPBUSD(acc3, va, _mm256_loadu_si256((const __m256i*)(w + 3 * row_size + i)));
+	}
+		#undef UCNN_DPBUSD
+	#else
+	for (int i = 0; i < row_size; i += 16)
+	{
+		const __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+		acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(va, _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w + i)))));
+		acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(va, _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w + row_size + i)))));
+		acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(va, _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w + 2 * row_size + i)))));
+		acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(va, _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w + 3 * row_size + i)))));
+	}
+	#endif
+	// [a0 a1 a2 a3] .. -> one vector of the 4 totals
+	const __m256i h01 = _mm256_hadd_epi32(acc0, acc1), h23 = _mm256_hadd_epi32(acc2, acc3);
+	const __m256i h = _mm256_hadd_epi32(h01, h23);
+	__m128i r = _mm_add_epi32(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1));
+	#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__))
+	r = _mm_sub_epi32(r, _mm_loadu_si128((const __m128i*)wsum));
+	#endif
+	_mm_storeu_si128((__m128i*)out, r);
+#elif defined(UCNN_SSE3)
+	__m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128(), acc2 = _mm_setzero_si128(), acc3 = _mm_setzero_si128();
+	for (int i = 0; i < row_size; i += 16)
+	{
+		const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		const __m128i alo = _mm_srai_epi16(_mm_unpacklo_epi8(va, va), 8), ahi = _mm_srai_epi16(_mm_unpackhi_epi8(va, va), 8);
+		__m128i vw;
+		vw = _mm_loadu_si128((const __m128i*)(w + i));
+		acc0 = _mm_add_epi32(acc0, _mm_add_epi32(_mm_madd_epi16(alo, _mm_srai_epi16(_mm_unpacklo_epi8(vw, vw), 8)), _mm_madd_epi16(ahi, _mm_srai_epi16(_mm_unpackhi_epi8(vw, vw), 8))));
+		vw = _mm_loadu_si128((const __m128i*)(w + row_size + i));
+		acc1 = _mm_add_epi32(acc1, _mm_add_epi32(_mm_madd_epi16(alo, _mm_srai_epi16(_mm_unpacklo_epi8(vw, vw), 8)), _mm_madd_epi16(ahi, _mm_srai_epi16(_mm_unpackhi_epi8(vw, vw), 8))));
+		vw = _mm_loadu_si128((const __m128i*)(w + 2 * row_size + i));
+		acc2 = _mm_add_epi32(acc2, _mm_add_epi32(_mm_madd_epi16(alo, _mm_srai_epi16(_mm_unpacklo_epi8(vw, vw), 8)), _mm_madd_epi16(ahi, _mm_srai_epi16(_mm_unpackhi_epi8(vw, vw), 8))));
+		vw = _mm_loadu_si128((const __m128i*)(w + 3 * row_size + i));
+		acc3 = _mm_add_epi32(acc3, _mm_add_epi32(_mm_madd_epi16(alo, _mm_srai_epi16(_mm_unpacklo_epi8(vw, vw), 8)), _mm_madd_epi16(ahi, _mm_srai_epi16(_mm_unpackhi_epi8(vw, vw), 8))));
+	}
+	// 4x4 transpose and add (SSE2 has no integer hadd)
+	const __m128i s01 = _mm_add_epi32(_mm_unpacklo_epi32(acc0, acc1), _mm_unpackhi_epi32(acc0, acc1));
+	const __m128i s23 = _mm_add_epi32(_mm_unpacklo_epi32(acc2, acc3), _mm_unpackhi_epi32(acc2, acc3));
+	_mm_storeu_si128((__m128i*)out, _mm_add_epi32(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23)));
+#else
+	for (int r = 0; r < 4; r++) out[r] = dot_i8(a, w + r*row_size, row_size);
+#endif
+}
+
+// symmetric quantization: q = round(x/scale) clamped to +/-127
+inline void quantize_i8(const float *x, signed char *q, const int size, const float scale)
+{
+	const float inv = scale > 0 ? 1.f / scale : 0.f;
+	for (int i = 0; i < size; i++)
+	{
+		float v = x[i] * inv;
+		v = v < 0 ? v - 0.5f : v + 0.5f;
+		if (v > 127.f) v = 127.f; else if (v < -127.f) v = -127.f;
+		q[i] = (signed char)(int)v;
+	}
+}
+
+//----------------------------------------------------------------------
+//  int8_network
+//  - runs a trained float network with int8 weights and activations for the
+//    fully connected and convolution layers. other layers stay float.
+//  - weights are quantized per output channel (fc row, conv map), activations per layer
+//    with scales found by calibrate()
+//  - usage:
+//		ucnn::int8_network q(cnn);
+//		for(..) q.calibrate(sample);   // representative data
+//		q.quantize();
+//		q.predict_class(img);  q.write("model_int8.txt");
+//    or to load:  ucnn::network cnn; ucnn::int8_network q(cnn); q.read("model_int8.txt");
+//
+class int8_network
+{
+	network &_net;
+	// per layer max |activation| seen in calibration, becomes scale = max/127
+	std::vector<float> _act_max;
+	std::vector<float> _act_scale;
+
+	// per connection (index into W). empty weights means the connection runs in float
+	struct int8_weights
+	{
+		int rows;       // output channels (fc nodes or conv maps)
+		int row_size;   // padded length of each row
+		std::vector<float> scale;        // per output channel
+		std::vector<signed char> w;      // rows x row_size, rows padded to a multiple of 4
+		std::vector<int> wsum;           // 128*sum of each row (u8 offset correction for VNNI)
+		int8_weights() : rows(0), row_size(0) {}
+		void alloc(int _rows, int _row_size)
+		{
+			rows = _rows; row_size = _row_size;
+			scale.assign(rows, 0.f);
+			w.assign(((rows + 3) / 4 * 4)*row_size, 0);
+		}
+		void finish()
+		{
+			wsum.assign(w.size() / row_size, 0);
+			for (int j = 0; j < (int)wsum.size(); j++)
+				for (int i = 0; i < row_size; i++) wsum[j] += 128 * w[j*row_size + i];
+		}
+	};
+	std::vector<int8_weights> _qw;
+	// layer index of the bottom layer of each connection
+	std::vector<int> _bottom_index;
+	// layers fed by exactly one int8 connection get dequantize + bias + activation in one pass
+	std::vector<char> _fused;
+
+	// scratch per thread
+	struct int8_scratch
+	{
+		std::vector<signed char> in;     // quantized input (conv: unwrapped, one padded row per output pixel)
+		std::vector<signed char> chan;   // quantized input channels for conv
+		std::vector<int> acc;            // int32 results
+	};
+	std::vector<int8_scratch> _scratch;
+	bool _quantized;
+
+	int layer_index(base_layer *l) { return _net.layer_map[l->name]; }
+
+	// conv weights are stored one padded row per map: [k*kernel_size + ky*kernel_cols + kx]
+	void quantize_connection(int w_index, base_layer *bottom, base_layer *top)
+	{
+		matrix tmp;
+		const matrix &w = _net.float_weights(w_index, tmp);
+		int8_weights &q = _qw[w_index];
+		convolution_layer *conv = dynamic_cast<convolution_layer*>(bottom);
+		if (conv)
+		{
+			const int kernel_size = conv->kernel_cols*conv->kernel_rows;
+			const int top_chans = top->node.chans;
+			q.alloc(conv->maps, int8_padded(kernel_size*top_chans));
+			std::vector<float> row(kernel_size*top_chans);
+			for (int map = 0; map < conv->maps; map++)
+			{
+				float max = 0;
+				for (int k = 0; k < top_chans; k++)
+					for (int i = 0; i < kernel_size; i++)
+					{
+						row[k*kernel_size + i] = w.x[(map + k*conv->maps)*kernel_size + i];
+						max = std::max(max, std::fabs(row[k*kernel_size + i]));
+					}
+				q.scale[map] = max / 127.f;
+				quantize_i8(row.data(), &q.w[map*q.row_size], (int)row.size(), q.scale[map]);
+			}
+		}
+		else
+		{
+			// fc: W rows are bottom nodes, cols are top nodes
+			q.alloc(w.rows, int8_padded(w.cols));
+			for (int j = 0; j < w.rows; j++)
+			{
+				float max = 0;
+				for (int i = 0; i < w.cols; i++) max = std::max(max, std::fabs(w.x[j*w.cols + i]));
+				q.scale[j] = max / 127.f;
+				quantize_i8(&w.x[j*w.cols], &q.w[j*q.row_size], w.cols, q.scale[j]);
+			}
+		}
+		q.finish();
+	}
+
+	// int8 forward of one connection. writes (fused) or adds the dequantized result into bottom.node
+	void run_connection(const int8_weights &q, const base_layer &top, base_layer &bottom, const float in_scale, const bool fused, int8_scratch &s)
+	{
+		convolution_layer *conv = dynamic_cast<convolution_layer*>(&bottom);
+		float *out = bottom.node.x;
+		if (conv)
+		{
+			const int kernel_size = conv->kernel_cols*conv->kernel_rows;
+			const int top_cols = top.node.cols;
+			const int top_size = top.node.cols*top.node.rows;
+			const int out_cols = bottom.node.cols, out_rows = bottom.node.rows;
+			const int map_size = out_cols*out_rows;
+			// quantize input once then unwrap each output pixel's receptive field into one padded row
+			s.chan.resize(top.node.size());
+			quantize_i8(top.node.x, s.chan.data(), top.node.size(), in_scale);
+			s.in.resize(map_size*q.row_size);
+			const int row_used = kernel_size*top.node.chans;
+			for (int j = 0; j < out_rows; j++)
+				for (int i = 0; i < out_cols; i++)
+				{
+					signed char *r = &s.in[(j*out_cols + i)*q.row_size];
+					memset(r + row_used, 0, q.row_size - row_used);
+					for (int k = 0; k < top.node.chans; k++)
+						for (int ky = 0; ky < conv->kernel_rows; ky++)
+						{
+							memcpy(r, &s.chan[k*top_size + (j + ky)*top_cols + i], conv->kernel_cols);
+							r += conv->kernel_cols;
+						}
+				}
+			// 4 maps at a time for each pixel, then dequantize (+ bias + activation if fused) per map
+			s.acc.resize(q.w.size() / q.row_size*map_size);
+			for (int p = 0; p < map_size; p++)
+			{
+				const signed char *a = &s.in[p*q.row_size];
+				for (int map = 0; map < q.rows; map += 4)
+				{
+					int r[4];
+					dot_i8_x4(a, &q.w[map*q.row_size], q.row_size, &q.wsum[map], r);
+					s.acc[map*map_size + p] = r[0]; s.acc[(map + 1)*map_size + p] = r[1];
+					s.acc[(map + 2)*map_size + p] = r[2]; s.acc[(map + 3)*map_size + p] = r[3];
+				}
+			}
+			for (int map = 0; map < q.rows; map++)
+			{
+				const float scale = in_scale*q.scale[map];
+				const int *acc = &s.acc[map*map_size];
+				float *o = out + map*map_size;
+				if (fused)
+				{
+					const float b = bottom.bias.x[map];
+					for (int p = 0; p < map_size; p++) { o[p] = scale*(float)acc[p]; o[p] = bottom.p_act->f(o, p, map_size, b); }
+				}
+				else
+					for (int p = 0; p < map_size; p++) o[p] += scale*(float)acc[p];
+			}
+			return;
+		}
+		s.in.assign(q.row_size, 0);
+		quantize_i8(top.node.x, s.in.data(), top.node.size(), in_scale);
+		const int size = q.rows;
+		s.acc.resize(q.w.size() / q.row_size);
+		for (int j = 0; j < size; j += 4) dot_i8_x4(s.in.data(), &q.w[j*q.row_size], q.row_size, &q.wsum[j], &s.acc[j]);
+		for (int j = 0; j < size; j++)
+		{
+			const float v = in_scale*q.scale[j] * (float)s.acc[j];
+			if (fused) { out[j] = v; out[j] = bottom.p_act->f(out, j, size, bottom.bias.x[j]); }
+			else out[j] += v;
+		}
+	}
+
+	void setup_graph()
+	{
+		const int layer_cnt = (int)_net.layer_sets[0].size();
+		_bottom_index.assign(_net.W.size(), -1);
+		std::vector<int> in_count(layer_cnt, 0);
+		for (int k = 0; k < layer_cnt; k++)
+		{
+			__for__(auto &link __in__ _net.layer_sets[0][k]->forward_linked_layers)
+			{
+				_bottom_index[link.first] = layer_index(link.second);
+				in_count[_bottom_index[link.first]]++;
+			}
+		}
+		_fused.assign(layer_cnt, 0);
+		for (int w = 0; w < (int)_qw.size(); w++)
+			if (_qw[w].rows > 0 && in_count[_bottom_index[w]] == 1) _fused[_bottom_index[w]] = 1;
+		_scratch.resize(_net.layer_sets.size());
+	}
+
+public:
+	int8_network(network &cnn) : _net(cnn), _quantized(false) {}
+
+	// run a representative sample through the float network and track activation ranges
+	// (not thread safe, call from one thread)
+	void calibrate(const float *in, int _thread_number = 0)
+	{
+		_net.forward(in, _thread_number);
+		const std::vector<base_layer *> &layers = _net.layer_sets[_thread_number];
+		if (_act_max.size() != layers.size()) _act_max.assign(layers.size(), 0.f);
+		for (int k = 0; k < (int)layers.size(); k++)
+		{
+			float min, max;
+			layers[k]->node.min_max(&min, &max);
+			_act_max[k] = std::max(_act_max[k], std::max(std::fabs(min), std::fabs(max)));
+		}
+	}
+
+	// build int8 weights from the float model. call after calibrate()
+	// if release_float_weights, the float copies of quantized W are freed (then only this class can run the model)
+	void quantize(bool release_float_weights = false)
+	{
+		const int layer_cnt = (int)_net.layer_sets[0].size();
+		if ((int)_act_max.size() != layer_cnt) bail("call calibrate() before quantize()");
+		_act_scale.resize(layer_cnt);
+		for (int k = 0; k < layer_cnt; k++) _act_scale[k] = _act_max[k] > 0 ? _act_max[k] / 127.f : 1.f;
+
+		_qw.assign(_net.W.size(), int8_weights());
+		for (int k = 0; k < layer_cnt; k++)
+		{
+			base_layer *top = _net.layer_sets[0][k];
+			__for__(auto &link __in__ top->forward_linked_layers)
+			{
+				// binary layers keep their 1 bit kernels
+				if (link.second->binary_weights()) continue;
+				if (dynamic_cast<fully_connected_layer*>(link.second) || dynamic_cast<convolution_layer*>(link.second))
+				{
+					quantize_connection(link.first, link.second, top);
+					if (release_float_weights) { delete _net.W[link.first]; _net.W[link.first] = new matrix(); }
+				}
+			}
+		}
+		setup_graph();
+		_quantized = true;
+	}
+
+	// bytes used by the int8 weights (plus scales)
+	size_t weight_bytes()
+	{
+		size_t b = 0;
+		__for__(auto &q __in__ _qw) b += q.w.size() + q.scale.size()*sizeof(float);
+		return b;
+	}
+
+	float* forward(const float *in, int _thread_number = -1)
+	{
+		if (!_quantized) bail("call quantize() or read()");
+		if (_thread_number < 0)
+		{
+#ifdef UCNN_OMP
+			_thread_number = omp_get_thread_num();
+#else
+			_thread_number = 0;
+#endif
+		}
+		if (_thread_number >= (int)_net.layer_sets.size()) bail("needed to call allow_threads()");
+		std::vector<base_layer *> &layers = _net.layer_sets[_thread_number];
+		int8_scratch &s = _scratch[_thread_number];
+
+		__for__(auto layer __in__ layers) layer->node.fill(0.f);
+		memcpy(layers[0]->node.x, in, sizeof(float)*layers[0]->node.size());
+
+		for (int k = 0; k < (int)layers.size(); k++)
+		{
+			base_layer *layer = layers[k];
+			if (!_fused[k]) layer->activate_nodes();
+			__for__(auto &link __in__ layer->forward_linked_layers)
+			{
+				const int8_weights &q = _qw[link.first];
+				if (q.rows > 0)
+					run_connection(q, *layer, *link.second, _act_scale[k], _fused[_bottom_index[link.first]] != 0, s);
+				else if (_net.Wbin[link.first])
+					link.second->accumulate_signal_binary(*layer, *_net.Wbin[link.first], 0);
+				else
+					link.second->accumulate_signal(*layer, *_net.W[link.first], 0);
+			}
+		}
+		return layers[layers.size() - 1]->node.x;
+	}
+
+	int predict_class(const float *in, int _thread_number = -1)
+	{
+		const float* out = forward(in, _thread_number);
+		return max_index(out, _net.out_size());
+	}
+
+	// model file: same layer/graph header as network::write, then '2' and binary data:
+	// activation scales, biases, then per connection: rows, row size, scales, int8 weights (or float W when rows==0)
+	bool write(const std::string &filename)
+	{
+		if (!_quantized) return false;
+		std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::binary);
+		if (!ofs.is_open()) return false;
+		_net.write_graph(ofs);
+		ofs << (int)2 << std::endl;
+		ofs.write((char*)_act_scale.data(), _act_scale.size()*sizeof(float));
+		__for__(auto l __in__ _net.layer_sets[0]) ofs.write((char*)l->bias.x, l->bias.size()*sizeof(float));
+		for (int j = 0; j < (int)_qw.size(); j++)
+		{
+			const int8_weights &q = _qw[j];
+			ofs.write((char*)&q.rows, sizeof(int));
+			ofs.write((char*)&q.row_size, sizeof(int));
+			if (q.rows > 0)
+			{
+				ofs.write((char*)q.scale.data(), q.scale.size()*sizeof(float));
+				ofs.write((char*)q.w.data(), q.w.size());
+			}
+			else ofs.write((char*)_net.W[j]->x, _net.W[j]->size()*sizeof(float));
+		}
+		return ofs.good();
+	}
+
+	// loads into the (empty) network passed to the constructor
+	bool read(const std::string &filename)
+	{
+		std::ifstream ifs(filename.c_str(), std::ios::in | std::ios::binary);
+		if (!ifs.is_open()) return false;
+		const int layer_cnt = _net.read_graph(ifs);
+		if (layer_cnt < 1) return false;
+		std::string s;
+		int type;
+		ifs >> type;
+		getline(ifs, s); // get endline
+		if (type != 2) return false;
+		_act_scale.resize(layer_cnt);
+		ifs.read((char*)_act_scale.data(), _act_scale.size()*sizeof(float));
+		__for__(auto l __in__ _net.layer_sets[0]) ifs.read((char*)l->bias.x, l->bias.size()*sizeof(float));
+		_qw.assign(_net.W.size(), int8_weights());
+		for (int j = 0; j < (int)_qw.size(); j++)
+		{
+			int8_weights &q = _qw[j];
+			ifs.read((char*)&q.rows, sizeof(int));
+			ifs.read((char*)&q.row_size, sizeof(int));
+			if (q.rows > 0)
+			{
+				q.alloc(q.rows, q.row_size);
+				ifs.read((char*)q.scale.data(), q.scale.size()*sizeof(float));
+				ifs.read((char*)q.w.data(), q.w.size());
+				q.finish();
+				// float copy isn't needed
+				delete _net.W[j]; _net.W[j] = new matrix();
+			}
+			else ifs.read((char*)_net.W[j]->x, _net.W[j]->size()*sizeof(float));
+		}
+		_net.sync_layer_sets();
+		setup_graph();
+		_quantized = ifs.good();
+		return _quantized;
+	}
+};
+
+} // namespace
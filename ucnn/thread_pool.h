@@ -0,0 +1,182 @@
+// == ucnn ====================================================================
+//
+//    Copyright (c) gnawice@gnawice.com. All rights reserved.
+//	  See LICENSE in root folder
+//
+//    This file is part of ucnn.
+//
+//    uncc is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as published
+//    by the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    ucnn is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with ucnn.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+//    thread_pool.h: std::thread worker pool
+//
+// ==================================================================== ucnn ==
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace ucnn {
+
+//----------------------------------------------------------------------------------------------------------
+// T H R E A D   P O O L
+// fork/join over tasks: parallel_for(n, f) runs f(task, thread) for tasks 0 .. n-1 on the workers and the calling
+// thread (thread 0, workers are 1 .. size()-1) and returns when all are done. each thread starts with an even,
+// contiguous share of the tasks and takes from its front. a thread that runs out steals the back half of another
+// thread's share, so uneven tasks balance out without a shared queue. a share is one 64 bit (front, back) word,
+// taking and stealing are single compare-exchanges.
+// workers spin a little before sleeping so back to back calls (one per layer) do not pay for a wake up.
+// only one parallel_for runs at a time, a call made while the pool is busy runs inline on its thread
+class thread_pool
+{
+	struct job
+	{
+		void (*run)(void *, int, int);
+		void *arg;
+		int tasks;
+		std::atomic<int> done, active;
+	};
+
+	std::vector<std::thread> _threads;
+	std::vector<std::atomic<unsigned long long>> _share; // per thread, tasks [front, back) of the running job
+	std::mutex _lock;
+	std::condition_variable _wake;
+	job *_job;                           // under _lock
+	std::atomic<unsigned int> _generation; // bumped for each job
+	std::atomic<bool> _busy;
+	bool _stop;
+
+	template<class F> static void call(void *f, int task, int thread) { (*(F *)f)(task, thread); }
+
+	static unsigned long long range(unsigned int front, unsigned int back) { return ((unsigned long long)front << 32) | back; }
+
+	bool take(int thread, int &task)
+	{
+		unsigned long long r = _share[thread].load();
+		while (true)
+		{
+			const unsigned int front = (unsigned int)(r >> 32), back = (unsigned int)r;
+			if (front >= back) return false;
+			if (_share[thread].compare_exchange_weak(r, range(front + 1, back))) { task = (int)front; return true; }
+		}
+	}
+
+	// only called once the thread's own share is empty, so nobody else changes it while it is set
+	bool steal(int thread, int &task)
+	{
+		const int n = (int)_share.size();
+		for (int i = 1; i < n; i++)
+		{
+			const int victim = (thread + i) % n;
+			unsigned long long r = _share[victim].load();
+			while (true)
+			{
+				const unsigned int front = (unsigned int)(r >> 32), back = (unsigned int)r;
+				if (front >= back) break;
+				const unsigned int mid = front + (back - front) / 2;
+				if (!_share[victim].compare_exchange_weak(r, range(front, mid))) continue;
+				task = (int)mid;
+				_share[thread].store(range(mid + 1, back));
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void work(job *j, int thread)
+	{
+		int task;
+		while (take(thread, task) || steal(thread, task)) { j->run(j->arg, task, thread); j->done++; }
+	}
+
+	void worker(int thread)
+	{
+		unsigned int seen = 0;
+		while (true)
+		{
+			for (int spin = 0; spin < 2000 && _generation.load() == seen; spin++) std::this_thread::yield();
+			job *j;
+			{
+				std::unique_lock<std::mutex> l(_lock);
+				_wake.wait(l, [&] { return _stop || _generation.load() != seen; });
+				if (_stop) return;
+				seen = _generation.load();
+				j = _job;
+				if (j) j->active++;
+			}
+			if (j) { work(j, thread); j->active--; }
+		}
+	}
+
+public:
+	// threads includes the caller, so threads-1 workers are started
+	thread_pool(int threads = 1) : _share(threads < 1 ? 1 : threads), _job(NULL), _generation(0), _busy(false), _stop(false)
+	{
+		for (int i = 1; i < threads; i++) _threads.push_back(std::thread(&thread_pool::worker, this, i));
+	}
+	~thread_pool()
+	{
+		{
+			std::unique_lock<std::mutex> l(_lock);
+			_stop = true;
+		}
+		_wake.notify_all();
+		for (int i = 0; i < (int)_threads.size(); i++) _threads[i].join();
+	}
+
+	int size() const { return (int)_threads.size() + 1; }
+
+	template<class F> void parallel_for(const int n, F &f)
+	{
+		if (n <= 1 || _threads.empty() || _busy.exchange(true))
+		{
+			for (int i = 0; i < n; i++) f(i, 0);
+			return;
+		}
+		job j;
+		j.run = &call<F>; j.arg = &f; j.tasks = n;
+		j.done = 0; j.active = 0;
+		const int threads = size();
+		for (int t = 0; t < threads; t++) _share[t].store(range(n*t / threads, n*(t + 1) / threads));
+		{
+			std::unique_lock<std::mutex> l(_lock);
+			_job = &j;
+			_generation++;
+		}
+		_wake.notify_all();
+		work(&j, 0);
+		while (j.done.load() < n) std::this_thread::yield();
+		{
+			std::unique_lock<std::mutex> l(_lock);
+			_job = NULL;
+		}
+		// a worker that took the job may still be between its last task and letting go
+		while (j.active.load() > 0) std::this_thread::yield();
+		_busy = false;
+	}
+
+	// tasks of chunk items: f(begin, end, thread) over [0, n)
+	template<class F> void parallel_for(const int n, const int chunk, F &f)
+	{
+		const int c = chunk < 1 ? 1 : chunk;
+		auto task = [&](int t, int thread) { const int b = t*c; f(b, b + c < n ? b + c : n, thread); };
+		parallel_for((n + c - 1) / c, task);
+	}
+};
+
+} // namespace
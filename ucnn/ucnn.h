@@ -47,6 +47,9 @@
 #include <chrono>
 #include "core_math.h"
 #include "network.h" // this is the important thing
+#include "quantize.h" // int8 inference
+#include "compress.h" // pruning
+#include "context.h" // thread safe execution contexts
 // this other stuff may be moved to utils
 
 